@@ -0,0 +1,515 @@
+/*
+ * Concurrent read-mostly open addressing hash table with tombstone
+ * bit map and epoch based reclamation.
+ *
+ * Copyright (c) 2020 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <cassert>
+
+#include <bit>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <memory>
+
+#include "hash_common.h"
+#include "hash_epoch.h"
+
+namespace ethical {
+
+/*
+ * concurrent_hash_map is a read-mostly hash_map for tables that are
+ * read by many threads and updated rarely. it uses the slot array and
+ * 2-bit tombstone bitmap of hash_map, allocated as a single block with
+ * a small table header.
+ *
+ * readers are wait-free. they announce an epoch in a reader record of
+ * their own, load the table pointer and probe the bitmap words with
+ * acquire loads, without writing any shared cache line. writers take a
+ * mutex. an entry is never changed or moved once it is published:
+ *
+ * - insert constructs the entry in an available slot, then publishes
+ *   it with a release store of its bitmap word.
+ * - update inserts the new entry further along the probe sequence,
+ *   then tombstones the old slot, so a reader sees the old or the new
+ *   value and never a partial one.
+ * - erase tombstones the slot. tombstones are never reused and their
+ *   entries stay constructed until the table is freed.
+ *
+ * when used and tombstoned slots reach the load factor, the writer
+ * copies the live entries to a new table, which doubles unless the
+ * tombstones make up purge_factor of the load, publishes it with a
+ * store of the table pointer, and retires the old table. a retired
+ * table is freed once no reader can still hold it (see hash_epoch).
+ *
+ * lookups copy the value out or pass it to a visitor inside the read
+ * section, since references cannot outlive it. only max_load_factor,
+ * purge_factor and mixer apply from the Policy.
+ */
+
+template <class Key, class Value,
+          class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>,
+          class Policy = hash_policy,
+          class Allocator = std::allocator<std::pair<const Key, Value>>>
+struct concurrent_hash_map
+{
+    static const size_t default_size =    (2<<3);  /* 16 */
+    static const size_t load_multiplier = (2<<16); /* 1.0 */
+    static const size_t load_factor =     (size_t)(Policy::max_load_factor * load_multiplier);
+    static const size_t load_min =        (2<<12); /* 0.0625 */
+    static const size_t load_max =        (2<<16) - (2<<12); /* 0.9375 */
+
+    static const size_t purge_factor =    (size_t)(Policy::purge_factor * load_multiplier);
+
+    static_assert(load_factor >= load_min && load_factor <= load_max,
+                  "max_load_factor must be between 0.0625 and 0.9375");
+    static_assert(purge_factor > 0 && purge_factor <= load_multiplier,
+                  "purge_factor must be greater than 0.0 and at most 1.0");
+    static_assert(!Policy::robin_hood && !Policy::backward_shift,
+                  "entries of concurrent_hash_map never move, so robin_hood "
+                  "and backward_shift are not supported");
+
+    struct data_type {
+        Key first;
+        Value second;
+    };
+
+    /* a table is one block holding this header, the data array and the
+     * bitmap. the header is immutable once the table is published */
+    struct table_type {
+        size_t limit;
+        data_type *data;
+        std::atomic<uint64_t> *bitmap;
+    };
+
+    static const size_t block_align =
+        alignof(data_type) > alignof(table_type) ? alignof(data_type) : alignof(table_type);
+
+    typedef hash_block<block_align> block_type;
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<block_type> block_allocator;
+    typedef std::allocator_traits<block_allocator> block_traits;
+    typedef hash_layout<Policy> layout;
+
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<Key, Value> value_type;
+    typedef Hash hasher;
+    typedef Pred key_equal;
+    typedef Policy policy_type;
+    typedef Allocator allocator_type;
+    typedef typename hash_mixer_for<typename Policy::mixer, Key>::type mixer_type;
+
+    std::atomic<table_type*> table;
+    std::atomic<size_t> used;
+    size_t tombs;
+    size_t max_load;
+    std::mutex writer;
+    std::vector<std::pair<uint64_t,table_type*>> retired;
+    [[no_unique_address]] Hash _hasher;
+    [[no_unique_address]] Pred _compare;
+    [[no_unique_address]] block_allocator _alloc;
+
+    /*
+     * constructors and destructor
+     */
+
+    /* initial_size is a slot count, rounded up to a power of two */
+    inline concurrent_hash_map() : concurrent_hash_map(default_size) {}
+    explicit inline concurrent_hash_map(const Allocator &alloc) :
+        concurrent_hash_map(default_size, Hash(), Pred(), alloc) {}
+    inline concurrent_hash_map(size_t initial_size, const Hash &hash = Hash(),
+                               const Pred &pred = Pred(),
+                               const Allocator &alloc = Allocator()) :
+        table(nullptr), used(0), tombs(0), max_load(load_factor),
+        _hasher(hash), _compare(pred), _alloc(alloc)
+    {
+        table.store(allocate_internal(std::bit_ceil(initial_size)));
+    }
+
+    /* the map must not be destroyed while other threads access it */
+    inline ~concurrent_hash_map()
+    {
+        for (auto &r : retired) deallocate_internal(r.second);
+        deallocate_internal(table.load());
+    }
+
+    concurrent_hash_map(const concurrent_hash_map &) = delete;
+    concurrent_hash_map& operator=(const concurrent_hash_map &) = delete;
+
+    /*
+     * member functions
+     */
+
+    inline size_t size() { return used.load(std::memory_order_relaxed); }
+    inline size_t capacity() { return table.load()->limit; }
+    inline float max_load_factor() { return (float)max_load / load_multiplier; }
+    inline uint64_t key_hash(const Key &key) { return mixer_type::mix(_hasher(key)); }
+    inline hasher hash_function() const { return _hasher; }
+    inline key_equal key_eq() const { return _compare; }
+    inline allocator_type get_allocator() const { return allocator_type(_alloc); }
+
+    /*
+     * bit manipulation helpers
+     */
+
+    enum bitmap_state {
+        available = 0, occupied = 1, deleted = 2, recycled = 3
+    };
+    static inline size_t bitmap_capacity(size_t limit)
+    {
+        return layout::bitmap_capacity(limit);
+    }
+    static inline size_t bitmap_idx(size_t i) { return i >> 5; }
+    static inline size_t bitmap_shift(size_t i) { return ((i << 1) & 63); }
+
+    static const uint64_t bitmap_even = 0x5555555555555555ull;
+
+    static inline uint64_t bitmap_mask(size_t n)
+    {
+        return n < 32 ? bitmap_even & ((1ull << (n << 1)) - 1) : bitmap_even;
+    }
+    static inline uint64_t bitmap_occupied(uint64_t w) { return w; }
+    static inline uint64_t bitmap_available(uint64_t w) { return ~(w | (w >> 1)); }
+    static inline size_t bitmap_ctz(uint64_t m) { return std::countr_zero(m) >> 1; }
+    static inline uint64_t bitmap_below(uint64_t m) { return m ? (m & -m) - 1 : ~0ull; }
+
+    /* the states of the slots from i to the end of its bitmap word */
+    static inline uint64_t bitmap_word(table_type *t, size_t i)
+    {
+        return t->bitmap[bitmap_idx(i)].load(std::memory_order_acquire) >> bitmap_shift(i);
+    }
+
+    /* sets the state of slot i, which readers see with the entry. only
+     * the writer stores bitmap words, so the word is read and replaced */
+    static inline void bitmap_store(table_type *t, size_t i, bitmap_state s)
+    {
+        std::atomic<uint64_t> &word = t->bitmap[bitmap_idx(i)];
+        uint64_t w = word.load(std::memory_order_relaxed);
+        w = (w & ~(3ull << bitmap_shift(i))) | ((uint64_t)s << bitmap_shift(i));
+        word.store(w, std::memory_order_release);
+    }
+
+    /* number of slots from i to the end of its bitmap word or the table */
+    static inline size_t bitmap_span(table_type *t, size_t i)
+    {
+        size_t n = 32 - (i & 31);
+        return n < t->limit - i ? n : t->limit - i;
+    }
+
+    /* calls fn for each occupied slot, and each deleted slot if
+     * tombstones is set, visiting one bitmap word at a time */
+    template <typename F>
+    static inline void bitmap_foreach(table_type *t, bool tombstones, F fn)
+    {
+        for (size_t i = 0; i < t->limit; i += 32) {
+            uint64_t w = bitmap_word(t, i);
+            uint64_t m = bitmap_occupied(w) | (tombstones ? w >> 1 : 0);
+            for (m &= bitmap_mask(t->limit - i); m; m &= m - 1) {
+                fn(i + bitmap_ctz(m));
+            }
+        }
+    }
+
+    /* smallest power of two capacity holding n entries within max_load */
+    static inline size_t capacity_for(size_t n, size_t max_load)
+    {
+        size_t l = std::bit_ceil(n);
+        while (n * load_multiplier / l > max_load) l <<= 1;
+        return l;
+    }
+
+    /* bytes of the table header, rounded up to the block alignment */
+    static inline size_t header_capacity()
+    {
+        return (sizeof(table_type) + block_align - 1) & ~(block_align - 1);
+    }
+
+    /* the number of blocks holding a table of limit slots */
+    static inline size_t block_count(size_t limit)
+    {
+        size_t size = header_capacity() + sizeof(data_type) * limit + bitmap_capacity(limit);
+        return (size + sizeof(block_type) - 1) / sizeof(block_type);
+    }
+
+    table_type* allocate_internal(size_t limit)
+    {
+        char *p = (char*)std::to_address(block_traits::allocate(_alloc, block_count(limit)));
+        table_type *t = new (p) table_type{ limit, nullptr, nullptr };
+        t->data = (data_type*)(p + header_capacity());
+        t->bitmap = (std::atomic<uint64_t>*)(p + header_capacity() + sizeof(data_type) * limit);
+        for (size_t k = 0; k < bitmap_capacity(limit) / sizeof(uint64_t); k++) {
+            new (&t->bitmap[k]) std::atomic<uint64_t>(0);
+        }
+        return t;
+    }
+
+    /* destroys the live and tombstoned entries, which stay constructed
+     * until the table is freed, and frees the block */
+    void deallocate_internal(table_type *t)
+    {
+        bitmap_foreach(t, true, [&](size_t i) {
+            t->data[i].~data_type();
+        });
+        size_t count = block_count(t->limit);
+        t->~table_type();
+        block_traits::deallocate(_alloc, std::pointer_traits<typename block_traits::pointer>
+            ::pointer_to(*(block_type*)t), count);
+    }
+
+    /**
+     * the implementation
+     */
+
+    /* returns the slot containing key or limit if key is not present.
+     * safe for readers: it reads only slots published as occupied */
+    size_t find_internal(table_type *t, const Key &key, uint64_t h)
+    {
+        size_t mask = t->limit - 1;
+        for (size_t i = h & mask; ; ) {
+            size_t n = bitmap_span(t, i);
+            uint64_t w = bitmap_word(t, i), m = bitmap_mask(n);
+            uint64_t avail = bitmap_available(w) & m;
+            uint64_t occ = bitmap_occupied(w) & m & bitmap_below(avail);
+            for (; occ; occ &= occ - 1) {
+                size_t j = i + bitmap_ctz(occ);
+                if (_compare(t->data[j].first, key)) return j;
+            }
+            if (avail) return t->limit;
+            i = (i + n) & mask;
+        }
+    }
+
+    /* returns the first available slot in the probe sequence from slot
+     * i. tombstones are skipped, as readers may still be reading them */
+    size_t free_internal(table_type *t, size_t i)
+    {
+        size_t mask = t->limit - 1;
+        for (;;) {
+            size_t n = bitmap_span(t, i);
+            uint64_t avail = bitmap_available(bitmap_word(t, i)) & bitmap_mask(n);
+            if (avail) return i + bitmap_ctz(avail);
+            i = (i + n) & mask;
+        }
+    }
+
+    /* copies the live entries to a new table of new_limit slots,
+     * publishes it and retires the current table. the new table is
+     * private until published, so its slots are filled directly */
+    void resize_internal(size_t new_limit)
+    {
+        table_type *o = table.load(std::memory_order_relaxed);
+        table_type *t = allocate_internal(new_limit);
+        bitmap_foreach(o, false, [&](size_t i) {
+            size_t j = free_internal(t, key_hash(o->data[i].first) & (new_limit - 1));
+            new (&t->data[j]) data_type(/* copy */ o->data[i]);
+            bitmap_store(t, j, occupied);
+        });
+        table.store(t);
+        retired.push_back({ hash_epoch::instance().advance(), o });
+        tombs = 0;
+        reclaim_internal();
+    }
+
+    /* frees the retired tables that no reader can still hold */
+    void reclaim_internal()
+    {
+        if (retired.empty()) return;
+        uint64_t oldest = hash_epoch::instance().oldest();
+        size_t k = 0;
+        for (auto &r : retired) {
+            if (r.first <= oldest) deallocate_internal(r.second);
+            else retired[k++] = r;
+        }
+        retired.resize(k);
+    }
+
+    /* claims an available slot for a new entry with hash h, rebuilding
+     * the table first if the slot would exceed the load factor */
+    size_t claim_internal(table_type *&t, uint64_t h)
+    {
+        if ((used.load(std::memory_order_relaxed) + tombs + 1) * load_multiplier >
+            max_load * t->limit) {
+            size_t live = used.load(std::memory_order_relaxed);
+            bool purge = tombs * load_multiplier >= purge_factor * (live + tombs);
+            resize_internal(purge ? t->limit : t->limit << 1);
+            t = table.load(std::memory_order_relaxed);
+        }
+        return free_internal(t, h & (t->limit - 1));
+    }
+
+    /* inserts an entry for key, or when assign is set replaces the entry
+     * for key with a new one. returns true if key was not present */
+    template <typename K, typename V>
+    bool insert_internal(K &&key, V &&value, bool assign)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        table_type *t = table.load(std::memory_order_relaxed);
+        uint64_t h = key_hash(key);
+        size_t i = find_internal(t, key, h);
+        if (i != t->limit && !assign) return false;
+        if (i != t->limit) {
+            /* a resize drops the old entry, whose copy is then replaced */
+            table_type *s = t;
+            size_t j = claim_internal(t, h);
+            if (t != s) i = find_internal(t, key, h);
+            new (&t->data[j].first) Key(std::forward<K>(key));
+            new (&t->data[j].second) Value(std::forward<V>(value));
+            bitmap_store(t, j, occupied);
+            bitmap_store(t, i, deleted);
+            tombs++;
+            return false;
+        }
+        size_t j = claim_internal(t, h);
+        new (&t->data[j].first) Key(std::forward<K>(key));
+        new (&t->data[j].second) Value(std::forward<V>(value));
+        bitmap_store(t, j, occupied);
+        used.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /* sets the load factor at which the table is rebuilt, clamped to
+     * [0.0625, 0.9375] so that probes always find an available slot.
+     * f is clamped before conversion, and NaN takes the minimum */
+    void max_load_factor(float f)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        float lo = (float)load_min / load_multiplier, hi = (float)load_max / load_multiplier;
+        f = !(f >= lo) ? lo : f > hi ? hi : f;
+        max_load = (size_t)(f * load_multiplier);
+        size_t new_limit = capacity_for(used.load(std::memory_order_relaxed) + tombs, max_load);
+        if (new_limit > table.load(std::memory_order_relaxed)->limit) {
+            resize_internal(new_limit);
+        }
+    }
+
+    /* sets the capacity to hold at least n entries without rebuilding */
+    void reserve(size_t n)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        size_t new_limit = capacity_for(n + tombs, max_load);
+        if (new_limit > table.load(std::memory_order_relaxed)->limit) {
+            resize_internal(new_limit);
+        }
+    }
+
+    /* replaces the table with an empty one of the same capacity */
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        table_type *o = table.load(std::memory_order_relaxed);
+        table.store(allocate_internal(o->limit));
+        retired.push_back({ hash_epoch::instance().advance(), o });
+        used.store(0, std::memory_order_relaxed);
+        tombs = 0;
+        reclaim_internal();
+    }
+
+    /* frees retired tables that readers have left since they retired */
+    void reclaim()
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        reclaim_internal();
+    }
+
+    /* inserts key and value if key is absent, returning true if inserted */
+    bool insert(const Key &key, const Value &value)
+    {
+        return insert_internal(key, value, false);
+    }
+
+    bool insert(Key &&key, Value &&value)
+    {
+        return insert_internal(std::move(key), std::move(value), false);
+    }
+
+    /* inserts key and value or replaces the value of an existing entry,
+     * returning true if inserted */
+    template <typename M>
+    bool insert_or_assign(const Key &key, M&& obj)
+    {
+        return insert_internal(key, std::forward<M>(obj), true);
+    }
+
+    template <typename M>
+    bool insert_or_assign(Key &&key, M&& obj)
+    {
+        return insert_internal(std::move(key), std::forward<M>(obj), true);
+    }
+
+    /* tombstones the entry for key, returning true if it was present */
+    bool erase(const Key &key)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        table_type *t = table.load(std::memory_order_relaxed);
+        size_t i = find_internal(t, key, key_hash(key));
+        if (i == t->limit) return false;
+        bitmap_store(t, i, deleted);
+        used.fetch_sub(1, std::memory_order_relaxed);
+        tombs++;
+        return true;
+    }
+
+    /*
+     * wait-free readers
+     */
+
+    /* copies the value for key to value, returning true if present */
+    bool find(const Key &key, Value &value)
+    {
+        return visit(key, [&](const Value &v) { value = v; });
+    }
+
+    bool contains(const Key &key)
+    {
+        return visit(key, [](const Value &) {});
+    }
+
+    /* calls fn with the value for key inside the read section, which
+     * keeps the entry alive, returning true if key is present */
+    template <typename F>
+    bool visit(const Key &key, F fn)
+    {
+        hash_epoch_guard g;
+        table_type *t = table.load();
+        size_t i = find_internal(t, key, key_hash(key));
+        if (i == t->limit) return false;
+        fn((const Value&)t->data[i].second);
+        return true;
+    }
+
+    /* calls fn with the key and value of each entry of the current table */
+    template <typename F>
+    void for_each(F fn)
+    {
+        hash_epoch_guard g;
+        table_type *t = table.load();
+        bitmap_foreach(t, false, [&](size_t i) {
+            fn((const Key&)t->data[i].first, (const Value&)t->data[i].second);
+        });
+    }
+};
+
+};
\ No newline at end of file
@@ -0,0 +1,486 @@
+/*
+ * Concurrent open addressing hash set of integer keys with a tombstone
+ * bit map claimed by compare and swap.
+ *
+ * Copyright (c) 2020 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+#include <bit>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <functional>
+#include <memory>
+#include <type_traits>
+
+#include "hash_common.h"
+#include "hash_epoch.h"
+
+namespace ethical {
+
+/*
+ * concurrent_hash_set is a hash_set without locks of integer, enum or
+ * pointer keys for concurrent insert, contains and erase, such as
+ * deduplicating events across worker threads. keys are stored in an
+ * array of atomic words beside the 2-bit state bitmap of hash_set, and
+ * slots change state by compare and swap on the bitmap word that holds
+ * them, so threads working in different words never wait on each other.
+ *
+ * slot states only advance: available -> claimed -> occupied -> deleted.
+ * an insert claims the first available slot of its probe sequence
+ * with the state claimed, which takes the value of recycled, stores the
+ * key and then marks the slot occupied, when the key becomes present. an
+ * insert that meets a slot claimed for a key not yet stored yields until
+ * the key is stored, which the claiming thread does with its next
+ * instruction. tombstones are never reused, so keys of slots never
+ * change and contains reads them without waiting.
+ *
+ * the last slot of each bitmap word is not used for keys: its state is
+ * the frozen flag of the word. when the claimed slots reach the load
+ * factor, a new table is linked to the table and every thread that
+ * reaches it helps resize: chunks of words are taken with fetch_add,
+ * each word is frozen with a compare and swap, which fails any later
+ * compare and swap on the word, and its keys are inserted into the new
+ * table. claims that are frozen before the key is marked occupied are
+ * retried in the new table. threads wait for chunks taken by others
+ * before moving to the new table. retired tables are reclaimed through
+ * hash_epoch.
+ *
+ * the set is not lock-free, as an operation can block on another
+ * thread in two places:
+ *
+ * - an insert that probes past a claimed slot yields until the claiming
+ *   thread stores its key, so a claimer descheduled between its compare
+ *   and swap and the store delays the inserts that reach the slot.
+ * - an operation that reaches a table being resized waits until the
+ *   chunks other threads have taken are migrated, so a descheduled
+ *   helper delays every operation until it finishes its chunk.
+ */
+
+template <class Key,
+          class Hash = std::hash<Key>,
+          class Policy = hash_policy,
+          class Allocator = std::allocator<Key>>
+struct concurrent_hash_set
+{
+    static const size_t default_size =    (2<<5);  /* 64 */
+    static const size_t chunk_size =      (2<<9);  /* 1024 */
+    static const size_t load_multiplier = (2<<16); /* 1.0 */
+    static const size_t load_factor =     (size_t)(Policy::max_load_factor * load_multiplier);
+    static const size_t load_min =        (2<<12); /* 0.0625 */
+    static const size_t load_max =        (2<<16) - (2<<12); /* 0.9375 */
+
+    static const size_t purge_factor =    (size_t)(Policy::purge_factor * load_multiplier);
+
+    static_assert(load_factor >= load_min && load_factor <= load_max,
+                  "max_load_factor must be between 0.0625 and 0.9375");
+    static_assert(purge_factor > 0 && purge_factor <= load_multiplier,
+                  "purge_factor must be greater than 0.0 and at most 1.0");
+    static_assert(std::is_integral_v<Key> || std::is_enum_v<Key> || std::is_pointer_v<Key>,
+                  "keys of concurrent_hash_set must be integers, enums or pointers");
+
+    /* a table is one block holding this header, the key array and the
+     * bitmap. limit is a multiple of 32 so that words are whole */
+    struct table_type {
+        size_t limit;
+        std::atomic<Key> *keys;
+        std::atomic<uint64_t> *bitmap;
+        std::atomic<table_type*> next;
+        std::atomic<size_t> claimed;   /* slots claimed, including tombstones */
+        std::atomic<size_t> cursor;    /* next chunk to migrate */
+        std::atomic<size_t> migrated;  /* chunks migrated */
+        uint64_t retire_epoch;
+        table_type *retire_next;
+    };
+
+    typedef hash_block<alignof(table_type)> block_type;
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<block_type> block_allocator;
+    typedef std::allocator_traits<block_allocator> block_traits;
+    typedef hash_layout<Policy> layout;
+
+    typedef Key key_type;
+    typedef Key value_type;
+    typedef Hash hasher;
+    typedef Policy policy_type;
+    typedef Allocator allocator_type;
+    typedef typename hash_mixer_for<typename Policy::mixer, Key>::type mixer_type;
+
+    std::atomic<table_type*> table;
+    std::atomic<size_t> used;
+    std::atomic<table_type*> retired;
+    [[no_unique_address]] Hash _hasher;
+    [[no_unique_address]] block_allocator _alloc;
+
+    /*
+     * constructors and destructor
+     */
+
+    /* initial_size is a slot count, rounded up to a power of two */
+    inline concurrent_hash_set() : concurrent_hash_set(default_size) {}
+    explicit inline concurrent_hash_set(const Allocator &alloc) :
+        concurrent_hash_set(default_size, Hash(), alloc) {}
+    inline concurrent_hash_set(size_t initial_size, const Hash &hash = Hash(),
+                               const Allocator &alloc = Allocator()) :
+        table(nullptr), used(0), retired(nullptr), _hasher(hash), _alloc(alloc)
+    {
+        size_t limit = std::bit_ceil(initial_size);
+        table.store(allocate_internal(limit < 32 ? 32 : limit));
+    }
+
+    /* the set must not be destroyed while other threads access it */
+    inline ~concurrent_hash_set()
+    {
+        for (table_type *t = retired.load(); t; ) {
+            table_type *next = t->retire_next;
+            deallocate_internal(t);
+            t = next;
+        }
+        deallocate_internal(table.load());
+    }
+
+    concurrent_hash_set(const concurrent_hash_set &) = delete;
+    concurrent_hash_set& operator=(const concurrent_hash_set &) = delete;
+
+    /*
+     * member functions
+     */
+
+    inline size_t size() { return used.load(std::memory_order_relaxed); }
+    inline size_t capacity() { return table.load()->limit; }
+    inline uint64_t key_hash(const Key &key) { return mixer_type::mix(_hasher(key)); }
+    inline hasher hash_function() const { return _hasher; }
+    inline allocator_type get_allocator() const { return allocator_type(_alloc); }
+
+    /*
+     * bit manipulation helpers
+     */
+
+    enum bitmap_state {
+        available = 0, occupied = 1, deleted = 2, claimed = 3
+    };
+    static inline size_t bitmap_capacity(size_t limit)
+    {
+        return layout::bitmap_capacity(limit);
+    }
+    static inline size_t bitmap_idx(size_t i) { return i >> 5; }
+    static inline size_t bitmap_shift(size_t i) { return ((i << 1) & 63); }
+
+    static const uint64_t bitmap_even = 0x5555555555555555ull;
+    static const uint64_t bitmap_frozen = 3ull << 62;
+    static const uint64_t bitmap_slots = bitmap_even & ~bitmap_frozen;
+
+    static inline bitmap_state bitmap_get(uint64_t w, size_t i)
+    {
+        return (bitmap_state)((w >> bitmap_shift(i)) & 3);
+    }
+    static inline uint64_t bitmap_with(uint64_t w, size_t i, bitmap_state s)
+    {
+        return (w & ~(3ull << bitmap_shift(i))) | ((uint64_t)s << bitmap_shift(i));
+    }
+
+    /* the most slots that may be claimed before the table is resized */
+    inline size_t max_claims(table_type *t)
+    {
+        return t->limit * load_factor / load_multiplier;
+    }
+
+    /* bytes of the table header, rounded up to the key alignment */
+    static inline size_t header_capacity()
+    {
+        return (sizeof(table_type) + alignof(std::atomic<Key>) - 1) &
+               ~(alignof(std::atomic<Key>) - 1);
+    }
+
+    /* the number of blocks holding a table of limit slots */
+    static inline size_t block_count(size_t limit)
+    {
+        size_t size = header_capacity() + sizeof(std::atomic<Key>) * limit;
+        size = ((size + 7) & ~7) + bitmap_capacity(limit);
+        return (size + sizeof(block_type) - 1) / sizeof(block_type);
+    }
+
+    table_type* allocate_internal(size_t limit)
+    {
+        char *p = (char*)std::to_address(block_traits::allocate(_alloc, block_count(limit)));
+        table_type *t = new (p) table_type{ limit, nullptr, nullptr, { nullptr },
+                                            { 0 }, { 0 }, { 0 }, 0, nullptr };
+        size_t key_size = (header_capacity() + sizeof(std::atomic<Key>) * limit + 7) & ~7;
+        t->keys = (std::atomic<Key>*)(p + header_capacity());
+        t->bitmap = (std::atomic<uint64_t>*)(p + key_size);
+        for (size_t i = 0; i < limit; i++) {
+            new (&t->keys[i]) std::atomic<Key>(Key());
+        }
+        for (size_t k = 0; k < limit / 32; k++) {
+            new (&t->bitmap[k]) std::atomic<uint64_t>(0);
+        }
+        return t;
+    }
+
+    void deallocate_internal(table_type *t)
+    {
+        size_t count = block_count(t->limit);
+        t->~table_type();
+        block_traits::deallocate(_alloc, std::pointer_traits<typename block_traits::pointer>
+            ::pointer_to(*(block_type*)t), count);
+    }
+
+    /**
+     * the implementation
+     */
+
+    enum probe_result { found, absent, frozen };
+
+    /* probes t for key from its home slot, calling fn(i, w) for each
+     * available slot i of bitmap word w until fn returns true. returns
+     * found with the slot and word of key, absent if an available slot
+     * ends the probe sequence, or frozen if a frozen word is reached.
+     * waits for keys of claimed slots to be stored if wait is set,
+     * otherwise claimed slots are treated as not yet present */
+    template <typename F>
+    probe_result probe_internal(table_type *t, const Key &key, uint64_t h,
+                                bool wait, size_t &slot, uint64_t &word, F fn)
+    {
+        size_t mask = t->limit - 1;
+        for (size_t i = h & mask; ; i = (i + 1) & mask) {
+            if ((i & 31) == 31) continue;
+            uint64_t w = t->bitmap[bitmap_idx(i)].load(std::memory_order_acquire);
+            for (;;) {
+                if (w & bitmap_frozen) return frozen;
+                bitmap_state s = bitmap_get(w, i);
+                if (s == claimed && wait) {
+                    std::this_thread::yield();
+                    w = t->bitmap[bitmap_idx(i)].load(std::memory_order_acquire);
+                    continue;
+                }
+                if (s == occupied && t->keys[i].load(std::memory_order_relaxed) == key) {
+                    slot = i;
+                    word = w;
+                    return found;
+                }
+                if (s != available) break;
+                slot = i;
+                word = w;
+                if (fn(i, w)) return absent;
+                /* the word changed, so the slot is examined again */
+                w = t->bitmap[bitmap_idx(i)].load(std::memory_order_acquire);
+            }
+        }
+    }
+
+    /* claims slot i of word w, stores key and marks it occupied. returns
+     * false if the word changed first, or frozen if it was frozen after
+     * the claim, with the claim dropped by the resize */
+    int claim_internal(table_type *t, size_t i, uint64_t w, const Key &key)
+    {
+        std::atomic<uint64_t> &word = t->bitmap[bitmap_idx(i)];
+        if (!word.compare_exchange_strong(w, bitmap_with(w, i, claimed),
+                                          std::memory_order_acq_rel)) {
+            return 0;
+        }
+        t->keys[i].store(key, std::memory_order_relaxed);
+        w = bitmap_with(w, i, claimed);
+        while (!word.compare_exchange_weak(w, bitmap_with(w, i, occupied),
+                                           std::memory_order_release)) {
+            if (w & bitmap_frozen) return -1;
+        }
+        return 1;
+    }
+
+    /* inserts key into t if absent. returns found, absent when inserted,
+     * or frozen if t is full or being resized */
+    probe_result insert_internal(table_type *t, const Key &key, uint64_t h)
+    {
+        bool reserved = false, full = false;
+        int claim = 0;
+        size_t slot;
+        uint64_t word;
+        probe_result r = probe_internal(t, key, h, true, slot, word,
+            [&](size_t i, uint64_t w) {
+                if (!reserved) {
+                    /* a claim is reserved against the load factor first,
+                     * so racing inserts never fill the table */
+                    if (t->claimed.fetch_add(1, std::memory_order_relaxed) >= max_claims(t)) {
+                        t->claimed.fetch_sub(1, std::memory_order_relaxed);
+                        full = true;
+                        return true;
+                    }
+                    reserved = true;
+                }
+                claim = claim_internal(t, i, w, key);
+                return claim != 0;
+            });
+        if (r == absent && !full && claim == 1) return absent;
+        if (r == found && reserved) t->claimed.fetch_sub(1, std::memory_order_relaxed);
+        if (r == found) return found;
+        return frozen;
+    }
+
+    /* the table after t, linked to t by the first thread to resize it */
+    table_type* next_internal(table_type *t)
+    {
+        table_type *n = t->next.load();
+        if (n) return n;
+        size_t live = used.load(std::memory_order_relaxed);
+        size_t tombs = t->claimed.load(std::memory_order_relaxed) - live;
+        bool purge = tombs * load_multiplier >= purge_factor * (live + tombs);
+        n = allocate_internal(purge ? t->limit : t->limit << 1);
+        table_type *expected = nullptr;
+        if (!t->next.compare_exchange_strong(expected, n)) {
+            deallocate_internal(n);
+            n = expected;
+        }
+        return n;
+    }
+
+    /* freezes the words of chunk c of t and inserts their keys into n */
+    void migrate_internal(table_type *t, table_type *n, size_t c)
+    {
+        size_t end = (c + 1) * chunk_size < t->limit ? (c + 1) * chunk_size : t->limit;
+        for (size_t i = c * chunk_size; i < end; i += 32) {
+            std::atomic<uint64_t> &word = t->bitmap[bitmap_idx(i)];
+            uint64_t w = word.load(std::memory_order_acquire);
+            while (!word.compare_exchange_weak(w, w | bitmap_frozen,
+                                               std::memory_order_acq_rel)) {}
+            uint64_t occ = w & ~(w >> 1) & bitmap_slots;
+            for (; occ; occ &= occ - 1) {
+                Key key = t->keys[i + (std::countr_zero(occ) >> 1)].load(std::memory_order_relaxed);
+                size_t slot;
+                uint64_t word;
+                probe_internal(n, key, key_hash(key), false, slot, word,
+                    [&](size_t j, uint64_t v) {
+                        if (claim_internal(n, j, v, key) == 0) return false;
+                        n->claimed.fetch_add(1, std::memory_order_relaxed);
+                        return true;
+                    });
+            }
+        }
+    }
+
+    /* helps resize t into its next table, waits for the chunks taken by
+     * other threads, and publishes and retires t. returns the next table */
+    table_type* resize_internal(table_type *t)
+    {
+        table_type *n = next_internal(t);
+        size_t chunks = (t->limit + chunk_size - 1) / chunk_size;
+        for (size_t c; (c = t->cursor.fetch_add(1)) < chunks; ) {
+            migrate_internal(t, n, c);
+            t->migrated.fetch_add(1, std::memory_order_release);
+        }
+        while (t->migrated.load(std::memory_order_acquire) < chunks) {
+            std::this_thread::yield();
+        }
+        table_type *expected = t;
+        if (table.compare_exchange_strong(expected, n)) {
+            retire_internal(t);
+        }
+        return n;
+    }
+
+    /* pushes t on the retired list and frees the retired tables that no
+     * reader can still hold */
+    void retire_internal(table_type *t)
+    {
+        t->retire_epoch = hash_epoch::instance().advance();
+        t->retire_next = retired.load();
+        while (!retired.compare_exchange_weak(t->retire_next, t)) {}
+
+        table_type *list = retired.exchange(nullptr);
+        uint64_t oldest = hash_epoch::instance().oldest();
+        while (list) {
+            table_type *next = list->retire_next;
+            if (list->retire_epoch <= oldest) {
+                deallocate_internal(list);
+            } else {
+                list->retire_next = retired.load();
+                while (!retired.compare_exchange_weak(list->retire_next, list)) {}
+            }
+            list = next;
+        }
+    }
+
+    /* inserts key if absent, returning true if inserted */
+    bool insert(const Key &key)
+    {
+        hash_epoch_guard g;
+        uint64_t h = key_hash(key);
+        for (table_type *t = table.load(); ; ) {
+            if (t->next.load()) {
+                t = resize_internal(t);
+                continue;
+            }
+            probe_result r = insert_internal(t, key, h);
+            if (r == found) return false;
+            if (r == absent) {
+                used.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            t = resize_internal(t);
+        }
+    }
+
+    /* returns true if key is present. keys being inserted concurrently
+     * are not yet present until their slot is marked occupied */
+    bool contains(const Key &key)
+    {
+        hash_epoch_guard g;
+        uint64_t h = key_hash(key);
+        for (table_type *t = table.load(); ; ) {
+            size_t slot;
+            uint64_t word;
+            probe_result r = probe_internal(t, key, h, false, slot, word,
+                [](size_t, uint64_t) { return true; });
+            if (r == found) return true;
+            if (r == absent && !t->next.load()) return false;
+            t = resize_internal(t);
+        }
+    }
+
+    /* erases key, returning true if it was present */
+    bool erase(const Key &key)
+    {
+        hash_epoch_guard g;
+        uint64_t h = key_hash(key);
+        for (table_type *t = table.load(); ; ) {
+            if (t->next.load()) {
+                t = resize_internal(t);
+                continue;
+            }
+            size_t i;
+            uint64_t w;
+            probe_result r = probe_internal(t, key, h, false, i, w,
+                [](size_t, uint64_t) { return true; });
+            if (r == absent) return false;
+            if (r == found) {
+                std::atomic<uint64_t> &word = t->bitmap[bitmap_idx(i)];
+                if (word.compare_exchange_strong(w, bitmap_with(w, i, deleted),
+                                                 std::memory_order_acq_rel)) {
+                    used.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+                if (!(w & bitmap_frozen)) continue;
+            }
+            t = resize_internal(t);
+        }
+    }
+};
+
+};
\ No newline at end of file
@@ -0,0 +1,299 @@
+/*
+ * Allocators for the open addressing hash tables.
+ *
+ * Copyright (c) 2020 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define HASH_ALLOCATOR_MMAP 1
+#endif
+
+namespace ethical {
+
+/*
+ * hash_large_allocator aligns tables to 64 byte cache lines and maps
+ * tables of at least Threshold bytes directly with mmap, aligned to a
+ * 2 MiB boundary and advised with MADV_HUGEPAGE where available, so
+ * that transparent huge pages back the table and random lookups in a
+ * large table take fewer TLB misses. smaller tables use aligned new.
+ *
+ *     ethical::hash_map<uint64_t,uint64_t,std::hash<uint64_t>,
+ *         std::equal_to<uint64_t>,ethical::hash_policy,
+ *         ethical::hash_large_allocator<char>> ht;
+ */
+
+template <class T, size_t Threshold = (2<<20) /* 2 MiB */>
+struct hash_large_allocator
+{
+    typedef T value_type;
+
+    static const size_t cache_line_size = (2<<5);  /* 64 */
+    static const size_t huge_page_size =  (2<<20); /* 2 MiB */
+    static const size_t threshold =       Threshold;
+
+    static const size_t alignment = alignof(T) > cache_line_size ?
+                                    alignof(T) : cache_line_size;
+
+    template <class U>
+    struct rebind { typedef hash_large_allocator<U,Threshold> other; };
+
+    hash_large_allocator() = default;
+    template <class U>
+    hash_large_allocator(const hash_large_allocator<U,Threshold>&) {}
+
+    T* allocate(size_t n)
+    {
+        size_t size = n * sizeof(T);
+#if HASH_ALLOCATOR_MMAP
+        if (size >= threshold) return (T*)map_internal(size);
+#endif
+        return (T*)::operator new(size, std::align_val_t(alignment));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        size_t size = n * sizeof(T);
+#if HASH_ALLOCATOR_MMAP
+        if (size >= threshold) return unmap_internal(p, size);
+#endif
+        ::operator delete(p, std::align_val_t(alignment));
+    }
+
+    template <class U>
+    bool operator==(const hash_large_allocator<U,Threshold>&) const { return true; }
+    template <class U>
+    bool operator!=(const hash_large_allocator<U,Threshold>&) const { return false; }
+
+#if HASH_ALLOCATOR_MMAP
+    static inline size_t round_up(size_t size)
+    {
+        return (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    }
+
+    /* maps one huge page more than needed and trims the ends so that
+     * the mapping starts on a huge page boundary */
+    static void* map_internal(size_t size)
+    {
+        size_t len = round_up(size), span = len + huge_page_size;
+        char *p = (char*)mmap(nullptr, span, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == (char*)MAP_FAILED) throw std::bad_alloc();
+        char *q = (char*)(((uintptr_t)p + huge_page_size - 1) & ~(huge_page_size - 1));
+        if (q != p) munmap(p, q - p);
+        if (q + len != p + span) munmap(q + len, (p + span) - (q + len));
+#if defined(MADV_HUGEPAGE)
+        madvise(q, len, MADV_HUGEPAGE);
+#endif
+        return q;
+    }
+
+    static void unmap_internal(void *p, size_t size)
+    {
+        munmap(p, round_up(size));
+    }
+#endif
+};
+
+/*
+ * hash_pool is a slab allocator for tables of many small containers.
+ * blocks are grouped into size classes by their size in granules of
+ * 16 bytes. a container always allocates the same block size for a
+ * given capacity and element type, so each class holds the tables of
+ * one capacity of one container type. blocks are carved from 64 KiB
+ * slabs and freed blocks are kept on a free list per class and reused
+ * for the next table of the class, so growing, shrinking, creating and
+ * destroying small tables does not go to the general allocator. blocks
+ * larger than max_block_size use aligned new.
+ *
+ * the pool is not synchronized and must outlive the tables allocated
+ * from it. slabs are released when the pool is destroyed.
+ */
+
+struct hash_pool
+{
+    static const size_t granule =         (2<<3);  /* 16 */
+    static const size_t max_block_size =  (2<<11); /* 4 KiB */
+    static const size_t slab_size =       (2<<15); /* 64 KiB */
+    static const size_t slab_header =     (2<<5);  /* 64 */
+    static const size_t class_count =     max_block_size / granule;
+
+    struct size_class
+    {
+        size_t block_size;
+        size_t slabs;   /* slabs carved into blocks of the class */
+        size_t blocks;  /* blocks carved from the slabs */
+        size_t used;    /* blocks allocated and not yet freed */
+        void *free_list;
+        char *next;
+        char *end;
+    };
+
+    struct pool_stats
+    {
+        size_t slabs;       /* slabs allocated */
+        size_t used;        /* blocks in use */
+        size_t free;        /* freed blocks held for reuse */
+        size_t used_bytes;  /* bytes of the blocks in use */
+        size_t free_bytes;  /* bytes of the freed blocks */
+        size_t large;       /* large blocks in use outside the slabs */
+    };
+
+    size_class classes[class_count];
+    void *slab_list;
+    size_t large;
+
+    hash_pool() : slab_list(nullptr), large(0)
+    {
+        for (size_t k = 0; k < class_count; k++) {
+            classes[k] = size_class{ (k + 1) * granule, 0, 0, 0, nullptr, nullptr, nullptr };
+        }
+    }
+
+    hash_pool(const hash_pool &) = delete;
+    hash_pool& operator=(const hash_pool &) = delete;
+
+    ~hash_pool()
+    {
+        while (slab_list) {
+            void *next = *(void**)slab_list;
+            ::operator delete(slab_list, std::align_val_t(slab_header));
+            slab_list = next;
+        }
+    }
+
+    static inline bool pooled(size_t size, size_t align)
+    {
+        return size <= max_block_size && align <= granule;
+    }
+
+    inline size_class& class_for(size_t size)
+    {
+        return classes[(size - 1) / granule];
+    }
+
+    void* allocate(size_t size, size_t align)
+    {
+        if (!pooled(size, align)) {
+            large++;
+            return ::operator new(size, std::align_val_t(align));
+        }
+        size_class &c = class_for(size);
+        c.used++;
+        if (c.free_list) {
+            void *p = c.free_list;
+            c.free_list = *(void**)p;
+            return p;
+        }
+        if (c.end - c.next < (ptrdiff_t)c.block_size) {
+            slab_internal(c);
+        }
+        void *p = c.next;
+        c.next += c.block_size;
+        c.blocks++;
+        return p;
+    }
+
+    void deallocate(void *p, size_t size, size_t align)
+    {
+        if (!pooled(size, align)) {
+            large--;
+            return ::operator delete(p, std::align_val_t(align));
+        }
+        size_class &c = class_for(size);
+        c.used--;
+        *(void**)p = c.free_list;
+        c.free_list = p;
+    }
+
+    /* links a new slab into the slab list and carves the class from it */
+    void slab_internal(size_class &c)
+    {
+        char *slab = (char*)::operator new(slab_size, std::align_val_t(slab_header));
+        *(void**)slab = slab_list;
+        slab_list = slab;
+        c.next = slab + slab_header;
+        c.end = slab + slab_size;
+        c.slabs++;
+    }
+
+    pool_stats stats() const
+    {
+        pool_stats s = { 0, 0, 0, 0, 0, large };
+        for (const size_class &c : classes) {
+            s.slabs += c.slabs;
+            s.used += c.used;
+            s.free += c.blocks - c.used;
+            s.used_bytes += c.used * c.block_size;
+            s.free_bytes += (c.blocks - c.used) * c.block_size;
+        }
+        return s;
+    }
+};
+
+/*
+ * hash_pool_allocator allocates from the hash_pool it points to. as
+ * with std::pmr allocators, the pool does not propagate on assignment
+ * and tables moved between pools are relocated. a default constructed
+ * allocator has no pool and uses aligned new, so the containers can be
+ * default constructed, while a pool is passed when constructing them:
+ *
+ *     typedef ethical::hash_map<uint32_t,uint32_t,std::hash<uint32_t>,
+ *         std::equal_to<uint32_t>,ethical::hash_policy,
+ *         ethical::hash_pool_allocator<char>> edge_map;
+ *
+ *     ethical::hash_pool pool;
+ *     ethical::hash_map<uint32_t,edge_map> graph;
+ *     graph.try_emplace(node, &pool);
+ */
+
+template <class T>
+struct hash_pool_allocator
+{
+    typedef T value_type;
+
+    hash_pool *pool;
+
+    hash_pool_allocator() : pool(nullptr) {}
+    hash_pool_allocator(hash_pool *pool) : pool(pool) {}
+    template <class U>
+    hash_pool_allocator(const hash_pool_allocator<U> &o) : pool(o.pool) {}
+
+    T* allocate(size_t n)
+    {
+        if (pool) return (T*)pool->allocate(n * sizeof(T), alignof(T));
+        return (T*)::operator new(n * sizeof(T), std::align_val_t(alignof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        if (pool) return pool->deallocate(p, n * sizeof(T), alignof(T));
+        ::operator delete(p, std::align_val_t(alignof(T)));
+    }
+
+    template <class U>
+    bool operator==(const hash_pool_allocator<U> &o) const { return pool == o.pool; }
+    template <class U>
+    bool operator!=(const hash_pool_allocator<U> &o) const { return pool != o.pool; }
+};
+
+};
\ No newline at end of file
@@ -0,0 +1,416 @@
+/*
+ * Policies and helpers shared by the open addressing hash tables.
+ *
+ * Copyright (c) 2020 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <atomic>
+#include <random>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
+
+namespace ethical {
+
+/*
+ * hash_policy holds the compile-time options of the containers. The
+ * defaults are overridden by deriving a policy and redefining members:
+ *
+ *     struct my_policy : ethical::hash_policy {
+ *         static const bool fingerprint = true;
+ *     };
+ *
+ * max_load_factor - default load factor at which the table doubles.
+ *                   tombstones count toward the load. it can be changed
+ *                   per instance at runtime with max_load_factor(float).
+ *
+ * purge_factor    - fraction of the load made up of tombstones at which
+ *                   a table at its maximum load is rehashed in place at
+ *                   the same capacity instead of doubling. this bounds
+ *                   memory under insert and erase churn. 1.0 disables it.
+ *
+ * backward_shift  - erase by shifting the following entries of the
+ *                   cluster back into the hole instead of leaving a
+ *                   tombstone, so lookups never walk deleted slots and
+ *                   tombs stays zero. erase costs a hash per entry moved.
+ *
+ * robin_hood      - keep the entries of each cluster in home slot order
+ *                   with a displacement byte per slot, so unsuccessful
+ *                   lookups stop at the first entry closer to its home.
+ *                   long displacements double a loaded table or saturate
+ *                   and erase always shifts back. hash_map and hash_set only.
+ *
+ * mixer           - finalizer applied to the hasher result before it is
+ *                   masked to a slot index. hash_mix_auto selects
+ *                   hash_mix_fibonacci for integral, enum and pointer
+ *                   keys and hash_mix_none for other keys. hash_mix_none
+ *                   opts out and hash_mix_xxh3 mixes all bits.
+ *
+ * store_hash      - keep the full hash of each entry in a slot array so
+ *                   that growth never calls the hasher and probes compare
+ *                   hashes before keys. useful for keys that are costly
+ *                   to hash or compare, at 8 bytes per slot.
+ *
+ * fingerprint     - store a 7-bit hash fingerprint per slot in a byte
+ *                   array after the bitmap, so probes filter 32 slots
+ *                   with a SIMD compare before any key is compared.
+ *                   useful for keys that are expensive to compare.
+ *
+ * inline_capacity - number of slots, zero or a power of two, stored
+ *                   with their metadata inside the container object.
+ *                   the table never shrinks below it and only moves to
+ *                   the allocator when it grows beyond it, so small
+ *                   containers are created and destroyed without
+ *                   allocating. containers with inline storage are not
+ *                   trivially relocatable and copy it when moved.
+ *
+ * split_links     - store the prev and next links of the linked
+ *                   containers in an array after the slot metadata
+ *                   instead of in the entries, so probes do not pull
+ *                   links into the cache and list walks do not pull
+ *                   keys and values. linked containers only.
+ *
+ * split_values    - store the keys of hash_map in the slots and the
+ *                   values in a parallel array after them, so probes
+ *                   scan densely packed keys and load a value only on
+ *                   a hit. suits large values. iterators then return a
+ *                   proxy of references to the key and value. hash_map
+ *                   only.
+ */
+
+/*
+ * hash mixers finalize the hasher result before its low bits are masked
+ * to a slot index, so that hashers with weak low bits, such as the
+ * identity std::hash of integers and pointers, do not pile strided keys
+ * into a few slots. the mixers are bijective so distinct hashes stay
+ * distinct.
+ */
+
+/* leaves the hash unchanged */
+struct hash_mix_none
+{
+    static inline uint64_t mix(uint64_t h) { return h; }
+};
+
+/* reverses the byte order of a 64-bit word */
+static inline uint64_t hash_bswap64(uint64_t h)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(h);
+#else
+    return __builtin_bswap64(h);
+#endif
+}
+
+/* fibonacci hashing: multiplies by 2^64/phi and byte swaps the product
+ * so that its top bits, which depend on every bit of the key, become
+ * the low bits that select the slot */
+struct hash_mix_fibonacci
+{
+    static inline uint64_t mix(uint64_t h)
+    {
+        return hash_bswap64(h * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+/* the xxh3 avalanche finalizer, which mixes every input bit into
+ * every output bit for a multiply and two shifts */
+struct hash_mix_xxh3
+{
+    static inline uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 37;
+        h *= 0x165667919e3779f9ull;
+        return h ^ (h >> 32);
+    }
+};
+
+/* selects hash_mix_fibonacci for keys whose std::hash is usually the
+ * identity and hash_mix_none for other keys */
+struct hash_mix_auto {};
+
+template <class Mixer, class Key>
+struct hash_mixer_for { typedef Mixer type; };
+
+template <class Key>
+struct hash_mixer_for<hash_mix_auto, Key>
+{
+    typedef std::conditional_t<std::is_integral_v<Key> || std::is_enum_v<Key> ||
+                               std::is_pointer_v<Key>,
+                               hash_mix_fibonacci, hash_mix_none> type;
+};
+
+struct hash_policy
+{
+    static constexpr float max_load_factor = 0.5f;
+    static constexpr float purge_factor = 0.5f;
+    static const bool backward_shift = false;
+    static const bool robin_hood = false;
+    static const bool store_hash = false;
+    typedef hash_mix_auto mixer;
+    static const bool fingerprint = false;
+    static const size_t inline_capacity = 0;
+    static const bool split_links = false;
+    static const bool split_values = false;
+    static const size_t parallel_resize = 0;
+    static const size_t resize_threads = 0;
+};
+
+/*
+ * hash_layout sizes the slot metadata that follows the data array: the
+ * bitmap, then the fingerprints, robin hood displacements and stored
+ * hashes of the policies that enable them, then LinkSize bytes of
+ * split links per slot.
+ */
+
+template <class Policy, size_t LinkSize = 0>
+struct hash_layout
+{
+    static constexpr size_t bitmap_capacity(size_t limit)
+    {
+        return (((limit + 3) >> 2) + 7) & ~7;
+    }
+    static constexpr size_t fingerprint_capacity(size_t limit)
+    {
+        return Policy::fingerprint ? (limit + 31) & ~31 : 0;
+    }
+    static constexpr size_t displacement_capacity(size_t limit)
+    {
+        return Policy::robin_hood ? (limit + 7) & ~7 : 0;
+    }
+    static constexpr size_t hash_capacity(size_t limit)
+    {
+        return Policy::store_hash ? limit * sizeof(uint64_t) : 0;
+    }
+    static constexpr size_t link_capacity(size_t limit)
+    {
+        return (limit * LinkSize + 7) & ~7;
+    }
+    static constexpr size_t metadata_capacity(size_t limit)
+    {
+        return bitmap_capacity(limit) + fingerprint_capacity(limit) +
+               displacement_capacity(limit) + hash_capacity(limit) +
+               link_capacity(limit);
+    }
+};
+
+/*
+ * hash_data_layout sizes the data array at the start of the table,
+ * which is limit slots of SlotSize bytes. with a ValueSize the slots
+ * hold only keys and are followed by a parallel array of values at
+ * the next multiple of ValueAlign. either is padded to 8 bytes for the
+ * metadata.
+ */
+
+template <size_t SlotSize, size_t ValueSize = 0, size_t ValueAlign = 1>
+struct hash_data_layout
+{
+    static constexpr size_t value_offset(size_t limit)
+    {
+        return (limit * SlotSize + ValueAlign - 1) & ~(ValueAlign - 1);
+    }
+    static constexpr size_t data_capacity(size_t limit)
+    {
+        return ValueSize ? (value_offset(limit) + limit * ValueSize + 7) & ~7 :
+                           (limit * SlotSize + 7) & ~7;
+    }
+};
+
+/* storage for the inline table of a policy with inline_capacity, which
+ * is empty when the policy has none */
+template <size_t Size, size_t Align>
+struct hash_inline_storage
+{
+    alignas(Align) unsigned char bytes[Size];
+    void* get() { return bytes; }
+};
+
+template <size_t Align>
+struct hash_inline_storage<0, Align>
+{
+    void* get() { return nullptr; }
+};
+
+/*
+ * is_trivially_relocatable marks types that can be moved to a new
+ * address with memcpy and without running the destructor at the old
+ * address. it defaults to trivially copyable types and is specialized
+ * for the containers, and can be specialized for user types.
+ */
+
+template <class T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+/* the unit in which the containers allocate their tables. allocators
+ * are rebound to it so that std::pmr resources, which take alignment
+ * from the value type, return memory aligned for the table */
+template <size_t Align>
+struct alignas(Align) hash_block { unsigned char bytes[Align]; };
+
+/* hints that the cache line containing p will be read soon */
+static inline void hash_prefetch(const void *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#elif defined(_M_X64) || defined(_M_IX86)
+    _mm_prefetch((const char*)p, _MM_HINT_T0);
+#endif
+}
+
+/*
+ * seeded hashing
+ */
+
+/* 64x64 to 128-bit multiply folded to 64 bits by xor of the halves */
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t al = (uint32_t)a, ah = a >> 32, bl = (uint32_t)b, bh = b >> 32;
+    uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64_t m = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    uint64_t lo = (m << 32) | (uint32_t)ll;
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (m >> 32);
+    return lo ^ hi;
+#endif
+}
+
+/* hashes len bytes at data with seed, reading 8 bytes at a time and
+ * mixing each word into the state with a wide multiply like wyhash */
+static inline uint64_t hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    uint64_t h = hash_mum(seed ^ 0xa0761d6478bd642full, len ^ 0xe7037ed1a0b428dbull);
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = hash_mum(w ^ 0xe7037ed1a0b428dbull, h ^ 0x8ebc6af09c88c6e3ull);
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, len);
+    return hash_mum(w ^ 0x589965cc75374cc3ull, h ^ 0x1d8e4e27c47d124full);
+}
+
+/* returns a different random seed on each call. the sequence starts
+ * from std::random_device and is stepped with an atomic counter */
+static inline uint64_t hash_random_seed()
+{
+    static std::atomic<uint64_t> state = []() {
+        std::random_device rd;
+        return ((uint64_t)rd() << 32) ^ rd();
+    }();
+    uint64_t s = state.fetch_add(0x9e3779b97f4a7c15ull, std::memory_order_relaxed);
+    return hash_mum(s ^ 0xa0761d6478bd642full, s ^ 0xe7037ed1a0b428dbull);
+}
+
+/*
+ * seeded_hash hashes keys with a random per-instance seed, so that keys
+ * cannot be crafted to share a probe sequence without knowing the seed.
+ * integral, enum and pointer keys, and keys convertible to string_view,
+ * are hashed with the seed directly. other keys are hashed with Hash and
+ * the result is mixed with the seed, which does not separate keys that
+ * collide in Hash itself.
+ */
+
+template <class Key, class Hash = std::hash<Key>>
+struct seeded_hash
+{
+    uint64_t seed;
+    [[no_unique_address]] Hash hash;
+
+    seeded_hash() : seed(hash_random_seed()) {}
+    explicit seeded_hash(uint64_t seed) : seed(seed) {}
+
+    size_t operator()(const Key &key) const
+    {
+        if constexpr (std::is_convertible_v<const Key&, std::string_view>) {
+            std::string_view v(key);
+            return (size_t)hash_bytes(v.data(), v.size(), seed);
+        } else if constexpr (std::is_integral_v<Key> || std::is_enum_v<Key> ||
+                             std::is_pointer_v<Key>) {
+            uint64_t v = (uint64_t)key;
+            return (size_t)hash_mum(v ^ seed, seed ^ 0xe7037ed1a0b428dbull);
+        } else {
+            uint64_t v = (uint64_t)hash(key);
+            return (size_t)hash_mum(v ^ seed, seed ^ 0xe7037ed1a0b428dbull);
+        }
+    }
+};
+
+/*
+ * fingerprint helpers
+ */
+
+/* 7-bit fingerprint from the high bits of a multiplicative mix of the
+ * hash, so it is independent of the low bits used for the slot index */
+static inline uint8_t hash_fingerprint(uint64_t h)
+{
+    return (uint8_t)((h * 0x9e3779b97f4a7c15ull) >> 57);
+}
+
+/* spreads 32 bits to the even bits of a 64-bit word (bit k to bit 2k) */
+static inline uint64_t spread_even(uint64_t m)
+{
+    m = (m | (m << 16)) & 0x0000ffff0000ffffull;
+    m = (m | (m << 8))  & 0x00ff00ff00ff00ffull;
+    m = (m | (m << 4))  & 0x0f0f0f0f0f0f0f0full;
+    m = (m | (m << 2))  & 0x3333333333333333ull;
+    m = (m | (m << 1))  & 0x5555555555555555ull;
+    return m;
+}
+
+/* compares 32 fingerprints with tag, returning a mask in bitmap layout
+ * with the even bit of entry k set when tags[k] == tag */
+static inline uint64_t fingerprint_match(const uint8_t *tags, uint8_t tag)
+{
+#if defined(__AVX2__)
+    __m256i t = _mm256_set1_epi8((char)tag);
+    __m256i v = _mm256_loadu_si256((const __m256i*)tags);
+    return spread_even((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, t)));
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i t = _mm_set1_epi8((char)tag);
+    __m128i v0 = _mm_loadu_si128((const __m128i*)tags);
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(tags + 16));
+    uint64_t m0 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v0, t));
+    uint64_t m1 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v1, t));
+    return spread_even(m0 | (m1 << 16));
+#else
+    uint64_t m = 0;
+    for (size_t k = 0; k < 32; k++) {
+        m |= (uint64_t)(tags[k] == tag) << (k << 1);
+    }
+    return m;
+#endif
+}
+
+};
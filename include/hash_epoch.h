@@ -0,0 +1,152 @@
+/*
+ * Epoch based reclamation for the concurrent hash tables.
+ *
+ * Copyright (c) 2020 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <atomic>
+
+namespace ethical {
+
+/*
+ * hash_epoch is a process wide epoch domain. each thread that reads a
+ * concurrent table owns a reader record, padded to a cache line, in
+ * which it announces the epoch it entered at. readers never write a
+ * shared line, so read sections on different cores do not contend.
+ *
+ * a writer that unlinks a table advances the epoch and retires the
+ * table with the new epoch. the table may be freed once every reader
+ * is idle or has entered at or after that epoch, because such readers
+ * entered after the table was unlinked and cannot hold it.
+ *
+ * all epoch and table pointer accesses are sequentially consistent, so
+ * a reader announcement is ordered before the table pointer load that
+ * follows it. read sections nest and must not block on a writer.
+ */
+
+struct hash_epoch
+{
+    static const size_t cache_line_size = (2<<5); /* 64 */
+    static const uint64_t idle = ~0ull;
+
+    struct alignas(cache_line_size) reader
+    {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> owned;
+        reader *next;
+        size_t depth;
+    };
+
+    std::atomic<uint64_t> global;
+    std::atomic<reader*> readers;
+
+    hash_epoch() : global(1), readers(nullptr) {}
+
+    hash_epoch(const hash_epoch &) = delete;
+    hash_epoch& operator=(const hash_epoch &) = delete;
+
+    ~hash_epoch()
+    {
+        reader *r = readers.load();
+        while (r) {
+            reader *next = r->next;
+            delete r;
+            r = next;
+        }
+    }
+
+    static hash_epoch& instance()
+    {
+        static hash_epoch domain;
+        return domain;
+    }
+
+    /* claims a record released by an exited thread or links a new one */
+    reader* acquire()
+    {
+        for (reader *r = readers.load(); r; r = r->next) {
+            bool expected = false;
+            if (!r->owned.load(std::memory_order_relaxed) &&
+                r->owned.compare_exchange_strong(expected, true)) {
+                return r;
+            }
+        }
+        reader *r = new reader{ { idle }, { true }, readers.load(), 0 };
+        while (!readers.compare_exchange_weak(r->next, r)) {}
+        return r;
+    }
+
+    /* the record of the calling thread, released when the thread exits */
+    static reader* local()
+    {
+        struct holder
+        {
+            reader *r;
+            holder() : r(instance().acquire()) {}
+            ~holder() { r->owned.store(false); }
+        };
+        static thread_local holder h;
+        return h.r;
+    }
+
+    /* enters a read section, announcing the current epoch */
+    static inline reader* enter()
+    {
+        reader *r = local();
+        if (r->depth++ == 0) r->epoch.store(instance().global.load());
+        return r;
+    }
+
+    static inline void leave(reader *r)
+    {
+        if (--r->depth == 0) r->epoch.store(idle, std::memory_order_release);
+    }
+
+    /* advances the epoch after an unlink, returning the retire epoch */
+    uint64_t advance()
+    {
+        return global.fetch_add(1) + 1;
+    }
+
+    /* the oldest epoch announced by a reader in a read section */
+    uint64_t oldest()
+    {
+        uint64_t e = idle;
+        for (reader *r = readers.load(); r; r = r->next) {
+            uint64_t a = r->epoch.load();
+            if (a < e) e = a;
+        }
+        return e;
+    }
+};
+
+/* enters a read section for the lifetime of the guard */
+struct hash_epoch_guard
+{
+    hash_epoch::reader *r;
+
+    hash_epoch_guard() : r(hash_epoch::enter()) {}
+    ~hash_epoch_guard() { hash_epoch::leave(r); }
+
+    hash_epoch_guard(const hash_epoch_guard &) = delete;
+    hash_epoch_guard& operator=(const hash_epoch_guard &) = delete;
+};
+
+};
\ No newline at end of file
@@ -24,8 +24,17 @@
 #include <cstddef>
 #include <cassert>
 
+#include <bit>
 #include <utility>
+#include <iterator>
 #include <functional>
+#include <memory>
+#include <initializer_list>
+#include <vector>
+#include <thread>
+#include <system_error>
+
+#include "hash_common.h"
 
 namespace ethical {
 
@@ -33,39 +42,114 @@ namespace ethical {
  * This open addressing hash_map uses a 2-bit entry per slot bitmap
  * that eliminates the need for empty and deleted key sentinels.
  * The hash_map has a simple array of key and value pairs and the
- * tombstone bitmap, which are allocated in a single call to malloc.
+ * tombstone bitmap, which are allocated as a single block from the
+ * Allocator, rebound to an aligned block type.
  */
 
 template <class Key, class Value,
           class Hash = std::hash<Key>,
-          class Pred = std::equal_to<Key>>
+          class Pred = std::equal_to<Key>,
+          class Policy = hash_policy,
+          class Allocator = std::allocator<std::pair<const Key, Value>>>
 struct hash_map
 {
     static const size_t default_size =    (2<<3);  /* 16 */
-    static const size_t load_factor =     (2<<15); /* 0.5 */
+    static const size_t min_size =        (2<<2);  /* 8 */
+    static const size_t prefetch_batch =  (2<<3);  /* 16 */
+    static const size_t resize_grain =    (2<<11); /* 4096 */
     static const size_t load_multiplier = (2<<16); /* 1.0 */
+    static const size_t load_factor =     (size_t)(Policy::max_load_factor * load_multiplier);
+    static const size_t load_min =        (2<<12); /* 0.0625 */
+    static const size_t load_max =        (2<<16) - (2<<12); /* 0.9375 */
+
+    static const size_t purge_factor =    (size_t)(Policy::purge_factor * load_multiplier);
+
+    static_assert(load_factor >= load_min && load_factor <= load_max,
+                  "max_load_factor must be between 0.0625 and 0.9375");
+    static_assert(purge_factor > 0 && purge_factor <= load_multiplier,
+                  "purge_factor must be greater than 0.0 and at most 1.0");
 
-    static inline Hash _hasher;
-    static inline Pred _compare;
+    static const bool relocatable =
+        is_trivially_relocatable<Key>::value &&
+        is_trivially_relocatable<Value>::value;
 
-    struct data_type {
+    /* entries hold their values unless the policy splits them out */
+    struct pair_data_type {
         Key first;
         Value second;
     };
+    struct split_data_type {
+        Key first;
+    };
+    typedef std::conditional_t<Policy::split_values,
+        split_data_type, pair_data_type> data_type;
+
+    static const size_t data_align = alignof(data_type) > alignof(uint64_t) ?
+                                     alignof(data_type) : alignof(uint64_t);
+    static const size_t block_align = Policy::split_values &&
+                                      alignof(Value) > data_align ?
+                                      alignof(Value) : data_align;
+
+    /* the table is allocated in units of block_type, which is aligned
+     * for the data array, the split values and the metadata words */
+    typedef hash_block<block_align> block_type;
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<block_type> block_allocator;
+    typedef std::allocator_traits<block_allocator> block_traits;
+    typedef hash_layout<Policy> layout;
+    typedef hash_data_layout<sizeof(data_type), Policy::split_values ?
+                             sizeof(Value) : 0, alignof(Value)> data_layout;
+
+    /* the first table of inline_capacity slots is stored in the object */
+    static const size_t inline_capacity = Policy::inline_capacity;
+    static const size_t inline_size = inline_capacity == 0 ? 0 :
+        data_layout::data_capacity(inline_capacity) + layout::metadata_capacity(inline_capacity);
+
+    static_assert(inline_capacity == 0 || std::has_single_bit(inline_capacity),
+                  "inline_capacity must be zero or a power of two");
 
     typedef Key key_type;
     typedef Value mapped_type;
     typedef std::pair<Key, Value> value_type;
     typedef Hash hasher;
     typedef Pred key_equal;
-    typedef data_type& reference;
-    typedef const data_type& const_reference;
+    typedef Policy policy_type;
+    typedef Allocator allocator_type;
+    typedef typename hash_mixer_for<typename Policy::mixer, Key>::type mixer_type;
+
+    /* with split_values iterators return references to the key and the
+     * value of a slot in place of a reference to the entry */
+    struct value_reference {
+        Key &first;
+        Value &second;
+    };
+    struct value_pointer {
+        value_reference r;
+        value_reference* operator->() { return &r; }
+    };
+    struct const_value_reference {
+        const Key &first;
+        const Value &second;
+    };
+    struct const_value_pointer {
+        const_value_reference r;
+        const_value_reference* operator->() { return &r; }
+    };
+    typedef std::conditional_t<Policy::split_values,
+        value_reference, data_type&> reference;
+    typedef std::conditional_t<Policy::split_values,
+        const_value_reference, const data_type&> const_reference;
 
     size_t used;
     size_t tombs;
     size_t limit;
+    size_t max_load;
     data_type *data;
     uint64_t *bitmap;
+    [[no_unique_address]] Hash _hasher;
+    [[no_unique_address]] Pred _compare;
+    [[no_unique_address]] block_allocator _alloc;
+    [[no_unique_address]] hash_inline_storage<inline_size, alignof(block_type)> _inline;
 
     /*
      * scanning iterator
@@ -76,47 +160,76 @@ struct hash_map
         hash_map *h;
         size_t i;
 
-        size_t step(size_t i) {
-            while (i < h->limit &&
-                   (bitmap_get(h->bitmap, i) & occupied) != occupied) i++;
-            return i;
-        }
+        size_t step(size_t i) { return h->bitmap_next(i); }
         iterator& operator++() { i = step(i+1); return *this; }
         iterator operator++(int) { iterator r = *this; ++(*this); return r; }
-        data_type& operator*() { i = step(i); return h->data[i]; }
-        data_type* operator->() { i = step(i); return &h->data[i]; }
+        reference operator*() { return h->slot_reference(i); }
+        auto operator->()
+        {
+            if constexpr (Policy::split_values) return value_pointer{ h->slot_reference(i) };
+            else return &h->data[i];
+        }
         bool operator==(const iterator &o) const { return h == o.h && i == o.i; }
         bool operator!=(const iterator &o) const { return h != o.h || i != o.i; }
     };
 
+    struct const_iterator
+    {
+        const hash_map *h;
+        size_t i;
+
+        size_t step(size_t i) { return h->bitmap_next(i); }
+        const_iterator& operator++() { i = step(i+1); return *this; }
+        const_iterator operator++(int) { const_iterator r = *this; ++(*this); return r; }
+        const_reference operator*() { return h->slot_reference(i); }
+        auto operator->()
+        {
+            if constexpr (Policy::split_values) return const_value_pointer{ h->slot_reference(i) };
+            else return (const data_type*)&h->data[i];
+        }
+        bool operator==(const const_iterator &o) const { return h == o.h && i == o.i; }
+        bool operator!=(const const_iterator &o) const { return h != o.h || i != o.i; }
+    };
+
     /*
      * constructors and destructor
      */
 
-    inline hash_map() : hash_map(default_size) {}
-    inline hash_map(size_t initial_size) :
-        used(0), tombs(0), limit(initial_size)
+    /* initial_size is a slot count, rounded up to a power of two */
+    inline hash_map() : hash_map(inline_capacity ? inline_capacity : default_size) {}
+    explicit inline hash_map(const Allocator &alloc) :
+        hash_map(inline_capacity ? inline_capacity : default_size, Hash(), Pred(), alloc) {}
+    inline hash_map(size_t initial_size, const Hash &hash = Hash(),
+                    const Pred &pred = Pred(),
+                    const Allocator &alloc = Allocator()) :
+        used(0), tombs(0), limit(std::bit_ceil(initial_size < inline_capacity ? inline_capacity : initial_size)), max_load(load_factor),
+        _hasher(hash), _compare(pred), _alloc(alloc)
     {
-        size_t data_size = sizeof(data_type) * limit;
-        size_t bitmap_size = bitmap_capacity(limit);
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
         size_t total_size = data_size + bitmap_size;
 
-        assert(is_pow2(limit));
-
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
         memset(bitmap, 0, bitmap_size);
     }
 
+    template <std::input_iterator It>
+    inline hash_map(It first, It last) :
+        hash_map(range_capacity(first, last))
+    {
+        insert(first, last);
+    }
+    inline hash_map(std::initializer_list<value_type> l) :
+        hash_map(l.begin(), l.end()) {}
+
     inline ~hash_map()
     {
         if (data) {
-            for (size_t i = 0; i < limit; i++) {
-                if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                    data[i].~data_type();
-                }
-            }
-            free(data);
+            bitmap_foreach(bitmap, limit, [&](size_t i) {
+                destroy_internal(i);
+            });
+            deallocate_internal(data, limit);
         }
     }
 
@@ -125,63 +238,105 @@ struct hash_map
      */
 
     inline hash_map(const hash_map &o) :
-        used(o.used), tombs(o.tombs), limit(o.limit)
+        used(o.used), tombs(o.tombs), limit(o.limit), max_load(o.max_load),
+        _hasher(o._hasher), _compare(o._compare),
+        _alloc(block_traits::select_on_container_copy_construction(o._alloc))
     {
-        size_t data_size = sizeof(data_type) * limit;
-        size_t bitmap_size = bitmap_capacity(limit);
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
         size_t total_size = data_size + bitmap_size;
 
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
 
         memcpy(bitmap, o.bitmap, bitmap_size);
-        for (size_t i = 0; i < limit; i++) {
-            if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                data[i] = /* copy */ o.data[i];
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            new (&data[i]) data_type(/* copy */ o.data[i]);
+            if constexpr (Policy::split_values) {
+                new (&values()[i]) Value(/* copy */ value_array(o.data, limit)[i]);
             }
-        }
+        });
     }
 
     inline hash_map(hash_map &&o) :
-        used(o.used), tombs(o.tombs), limit(o.limit),
-        data(o.data), bitmap(o.bitmap)
+        used(o.used), tombs(o.tombs), limit(o.limit), max_load(o.max_load),
+        data(o.data), bitmap(o.bitmap), _hasher(o._hasher), _compare(o._compare),
+        _alloc(o._alloc)
     {
-        o.data = nullptr;
-        o.bitmap = nullptr;
+        if (o.inline_internal()) {
+            move_internal(o);
+        } else {
+            o.data = nullptr;
+            o.bitmap = nullptr;
+        }
     }
 
     inline hash_map& operator=(const hash_map &o)
     {
-        free(data);
+        if (this == &o) return *this;
+
+        if (data) {
+            bitmap_foreach(bitmap, limit, [&](size_t i) {
+                destroy_internal(i);
+            });
+            deallocate_internal(data, limit);
+        }
 
         used = o.used;
         tombs = o.tombs;
         limit = o.limit;
+        max_load = o.max_load;
+        _hasher = o._hasher;
+        _compare = o._compare;
+        if constexpr (block_traits::propagate_on_container_copy_assignment::value) {
+            _alloc = o._alloc;
+        }
 
-        size_t data_size = sizeof(data_type) * limit;
-        size_t bitmap_size = bitmap_capacity(limit);
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
         size_t total_size = data_size + bitmap_size;
 
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
 
         memcpy(bitmap, o.bitmap, bitmap_size);
-        for (size_t i = 0; i < limit; i++) {
-            if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                data[i] = /* copy */ o.data[i];
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            new (&data[i]) data_type(/* copy */ o.data[i]);
+            if constexpr (Policy::split_values) {
+                new (&values()[i]) Value(/* copy */ value_array(o.data, limit)[i]);
             }
-        }
+        });
 
         return *this;
     }
 
     inline hash_map& operator=(hash_map &&o)
     {
+        if (this == &o) return *this;
+
+        if (data) {
+            bitmap_foreach(bitmap, limit, [&](size_t i) {
+                destroy_internal(i);
+            });
+            deallocate_internal(data, limit);
+        }
+
+        if constexpr (block_traits::propagate_on_container_move_assignment::value) {
+            _alloc = o._alloc;
+        }
+        if (o.inline_internal() || _alloc != o._alloc) {
+            move_internal(o);
+            return *this;
+        }
+
         data = o.data;
         bitmap = o.bitmap;
         used = o.used;
         tombs = o.tombs;
         limit = o.limit;
+        max_load = o.max_load;
+        _hasher = o._hasher;
+        _compare = o._compare;
 
         o.data = nullptr;
         o.bitmap = nullptr;
@@ -196,12 +351,19 @@ struct hash_map
     inline size_t size() { return used; }
     inline size_t capacity() { return limit; }
     inline size_t load() { return (used + tombs) * load_multiplier / limit; }
+    inline float max_load_factor() { return (float)max_load / load_multiplier; }
+    inline bool purge_due() { return tombs * load_multiplier >= purge_factor * (used + tombs); }
     inline size_t index_mask() { return limit - 1; }
     inline size_t hash_index(uint64_t h) { return h & index_mask(); }
-    inline size_t key_index(Key key) { return hash_index(_hasher(key)); }
+    inline uint64_t key_hash(const Key &key) { return mixer_type::mix(_hasher(key)); }
+    inline size_t key_index(const Key &key) { return hash_index(key_hash(key)); }
     inline hasher hash_function() const { return _hasher; }
-    inline iterator begin() { return iterator{ this, 0 }; }
+    inline key_equal key_eq() const { return _compare; }
+    inline allocator_type get_allocator() const { return allocator_type(_alloc); }
+    inline iterator begin() { return iterator{ this, bitmap_next(0) }; }
     inline iterator end() { return iterator{ this, limit }; }
+    inline const_iterator begin() const { return const_iterator{ this, bitmap_next(0) }; }
+    inline const_iterator end() const { return const_iterator{ this, limit }; }
 
     /*
      * bit manipulation helpers
@@ -212,7 +374,7 @@ struct hash_map
     };
     static inline size_t bitmap_capacity(size_t limit)
     {
-        return (((limit + 3) >> 2) + 7) & ~7;
+        return layout::bitmap_capacity(limit);
     }
     static inline size_t bitmap_idx(size_t i) { return i >> 5; }
     static inline size_t bitmap_shift(size_t i) { return ((i << 1) & 63); }
@@ -230,6 +392,291 @@ struct hash_map
     }
     static inline bool is_pow2(intptr_t n) { return  ((n & -n) == n); }
 
+    /* smallest power of two capacity holding n entries within max_load,
+     * and at least min_size */
+    static inline size_t capacity_for(size_t n, size_t max_load)
+    {
+        size_t l = std::bit_ceil(n < min_size ? min_size : n);
+        while (n * load_multiplier / l > max_load) l <<= 1;
+        return l;
+    }
+    template <std::input_iterator It>
+    static inline size_t range_capacity(It first, It last)
+    {
+        if constexpr (std::forward_iterator<It>) {
+            return capacity_for((size_t)std::distance(first, last), load_factor);
+        } else {
+            return default_size;
+        }
+    }
+
+    /*
+     * word-at-a-time helpers decode the states of up to 32 slots from
+     * one bitmap word. masks have one bit per slot at the even bit of
+     * each 2-bit entry so that slot offsets are recovered with ctz/2.
+     */
+
+    static const uint64_t bitmap_even = 0x5555555555555555ull;
+
+    static inline uint64_t bitmap_word(uint64_t *bitmap, size_t i)
+    {
+        return bitmap[bitmap_idx(i)] >> bitmap_shift(i);
+    }
+    static inline uint64_t bitmap_mask(size_t n)
+    {
+        return n < 32 ? bitmap_even & ((1ull << (n << 1)) - 1) : bitmap_even;
+    }
+    static inline uint64_t bitmap_occupied(uint64_t w) { return w; }
+    static inline uint64_t bitmap_available(uint64_t w) { return ~(w | (w >> 1)); }
+    static inline uint64_t bitmap_free(uint64_t w) { return ~w; }
+    static inline size_t bitmap_ctz(uint64_t m) { return std::countr_zero(m) >> 1; }
+    static inline uint64_t bitmap_below(uint64_t m) { return m ? (m & -m) - 1 : ~0ull; }
+    static inline uint64_t bitmap_unplaced(uint64_t w) { return ~(w ^ (w >> 1)); }
+
+    /* number of slots from i to the end of its bitmap word or the table */
+    inline size_t bitmap_span(size_t i) const
+    {
+        size_t n = 32 - (i & 31);
+        return n < limit - i ? n : limit - i;
+    }
+
+    /*
+     * fingerprint helpers: one byte per slot after the bitmap, padded
+     * to a whole bitmap word so that 32 slots are compared at once.
+     */
+
+    static inline size_t fingerprint_capacity(size_t limit)
+    {
+        return layout::fingerprint_capacity(limit);
+    }
+    inline uint8_t* fingerprints()
+    {
+        return (uint8_t*)bitmap + bitmap_capacity(limit);
+    }
+    inline uint64_t fingerprint_mask(size_t i, uint8_t tag)
+    {
+        return fingerprint_match(fingerprints() + (i & ~31), tag) >> bitmap_shift(i);
+    }
+    inline void fingerprint_set(size_t i, uint64_t h)
+    {
+        if constexpr (Policy::fingerprint) fingerprints()[i] = hash_fingerprint(h);
+    }
+
+    /*
+     * robin hood helpers: one byte per slot after the fingerprints holds
+     * one more than the distance of the entry from its home slot, or 0
+     * for an empty slot, so probes need not read the bitmap. insertion
+     * keeps the entries of a cluster in home slot order, so a probe
+     * stops at the first entry closer to its home than the probe. the
+     * byte saturates at displacement_max, and the distance of such an
+     * entry is found from its hash, so probes scan on past it.
+     */
+
+    static const size_t displacement_max = 255;
+
+    static inline size_t displacement_capacity(size_t limit)
+    {
+        return layout::displacement_capacity(limit);
+    }
+    inline uint8_t* displacements()
+    {
+        return fingerprints() + fingerprint_capacity(limit);
+    }
+    static inline uint8_t displacement_byte(size_t d)
+    {
+        return (uint8_t)(d + 1 < displacement_max ? d + 1 : displacement_max);
+    }
+    /* the distance of the entry in occupied slot i from its home slot */
+    inline size_t displacement(size_t i)
+    {
+        uint8_t d = displacements()[i];
+        if (d < displacement_max) return d - 1;
+        return (i - hash_index(slot_hash(i))) & index_mask();
+    }
+
+
+    /*
+     * stored hash helpers: the full hash of each entry is kept in a slot
+     * array after the other metadata, so that growth never calls the
+     * hasher and probes compare hashes before comparing keys.
+     */
+
+    static inline size_t hash_capacity(size_t limit)
+    {
+        return layout::hash_capacity(limit);
+    }
+    static inline uint64_t* hash_array(uint64_t *bitmap, size_t limit)
+    {
+        return (uint64_t*)((char*)bitmap + bitmap_capacity(limit) +
+                           fingerprint_capacity(limit) + displacement_capacity(limit));
+    }
+    inline uint64_t* hashes() { return hash_array(bitmap, limit); }
+    inline void hash_store(size_t i, uint64_t h)
+    {
+        if constexpr (Policy::store_hash) hashes()[i] = h;
+    }
+    inline bool hash_match(size_t i, uint64_t h)
+    {
+        if constexpr (Policy::store_hash) return hashes()[i] == h;
+        else return true;
+    }
+
+    /* returns the hash of the entry in slot i */
+    inline uint64_t slot_hash(size_t i)
+    {
+        if constexpr (Policy::store_hash) return hashes()[i];
+        else return key_hash(data[i].first);
+    }
+
+    /* bytes of slot metadata allocated after the data array */
+    static inline size_t metadata_capacity(size_t limit)
+    {
+        return layout::metadata_capacity(limit);
+    }
+
+    /*
+     * value helpers: the value of slot i is in its entry, or with
+     * split_values in a slot array between the keys and the metadata.
+     */
+
+    static inline size_t data_capacity(size_t limit)
+    {
+        return data_layout::data_capacity(limit);
+    }
+    static inline Value* value_array(data_type *data, size_t limit)
+    {
+        return (Value*)((char*)data + data_layout::value_offset(limit));
+    }
+    inline Value* values() { return value_array(data, limit); }
+    inline Value& slot_value(size_t i)
+    {
+        if constexpr (Policy::split_values) return values()[i];
+        else return data[i].second;
+    }
+    inline reference slot_reference(size_t i)
+    {
+        if constexpr (Policy::split_values) return reference{ data[i].first, values()[i] };
+        else return data[i];
+    }
+    inline const_reference slot_reference(size_t i) const
+    {
+        if constexpr (Policy::split_values) {
+            return const_reference{ data[i].first, value_array(data, limit)[i] };
+        } else {
+            return data[i];
+        }
+    }
+
+    /* moves the entry and the value of slot src to the empty slot dst */
+    inline void relocate_internal(size_t dst, size_t src)
+    {
+        relocate(&data[dst], &data[src]);
+        if constexpr (Policy::split_values) relocate(&values()[dst], &values()[src]);
+    }
+
+    /* ends the lifetime of the entry and the value of slot i */
+    inline void destroy_internal(size_t i)
+    {
+        data[i].~data_type();
+        if constexpr (Policy::split_values) values()[i].~Value();
+    }
+
+    /* returns the first occupied slot at or after slot i, or limit */
+    inline size_t bitmap_next(size_t i) const
+    {
+        while (i < limit) {
+            size_t n = bitmap_span(i);
+            uint64_t occ = bitmap_occupied(bitmap_word(bitmap, i)) & bitmap_mask(n);
+            if (occ) return i + bitmap_ctz(occ);
+            i += n;
+        }
+        return limit;
+    }
+
+    /* calls fn for each occupied slot, visiting one bitmap word at a time */
+    template <typename F>
+    static inline void bitmap_foreach(uint64_t *bitmap, size_t limit, F fn)
+    {
+        for (size_t i = 0; i < limit; i += 32) {
+            uint64_t occ = bitmap_occupied(bitmap[bitmap_idx(i)]);
+            for (occ &= bitmap_mask(limit - i); occ; occ &= occ - 1) {
+                fn(i + bitmap_ctz(occ));
+            }
+        }
+    }
+
+    /* moves the element at src to uninitialized dst and ends the
+     * lifetime of src, with memcpy for trivially relocatable types */
+    template <typename T>
+    static inline void relocate(T *dst, T *src)
+    {
+        if constexpr (relocatable) {
+            memcpy((void*)dst, (void*)src, sizeof(T));
+        } else {
+            new (dst) T(std::move(*src));
+            src->~T();
+        }
+    }
+
+    /* the number of blocks holding size bytes */
+    static inline size_t block_count(size_t size)
+    {
+        return (size + sizeof(block_type) - 1) / sizeof(block_type);
+    }
+
+    /* whether the table is in the inline storage of the object */
+    inline bool inline_internal()
+    {
+        return inline_capacity && data == (data_type*)_inline.get();
+    }
+
+    /* tables of inline_capacity slots, which are the smallest tables,
+     * take the inline storage and larger tables take a block */
+    data_type* allocate_internal(size_t size)
+    {
+        if (size <= inline_size) return (data_type*)_inline.get();
+        return (data_type*)std::to_address(block_traits::allocate(_alloc, block_count(size)));
+    }
+
+    void deallocate_internal(data_type *p, size_t limit)
+    {
+        if (inline_capacity && p == (data_type*)_inline.get()) return;
+        size_t size = data_capacity(limit) + metadata_capacity(limit);
+        block_traits::deallocate(_alloc, std::pointer_traits<typename block_traits::pointer>
+            ::pointer_to(*(block_type*)p), block_count(size));
+    }
+
+    /* moves the entries of o into a table of our own, leaving o empty.
+     * used when moving from a table in the inline storage of o, or by
+     * move assignment when the allocators are unequal and do not
+     * propagate, so the block of o cannot be taken over */
+    void move_internal(hash_map &o)
+    {
+        used = o.used;
+        tombs = o.tombs;
+        limit = o.limit;
+        max_load = o.max_load;
+        _hasher = o._hasher;
+        _compare = o._compare;
+
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
+        size_t total_size = data_size + bitmap_size;
+
+        data = allocate_internal(total_size);
+        bitmap = (uint64_t*)((char*)data + data_size);
+
+        memcpy(bitmap, o.bitmap, bitmap_size);
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            relocate(&data[i], &o.data[i]);
+            if constexpr (Policy::split_values) {
+                relocate(&values()[i], &value_array(o.data, limit)[i]);
+            }
+        });
+        memset(o.bitmap, 0, bitmap_size);
+        o.used = o.tombs = 0;
+    }
+
     /**
      * the implementation
      */
@@ -237,137 +684,649 @@ struct hash_map
     void resize_internal(data_type *old_data, uint64_t *old_bitmap,
                          size_t old_limit, size_t new_limit)
     {
-        size_t data_size = sizeof(data_type) * new_limit;
-        size_t bitmap_size = bitmap_capacity(new_limit);
+        size_t data_size = data_capacity(new_limit);
+        size_t bitmap_size = metadata_capacity(new_limit);
         size_t total_size = data_size + bitmap_size;
 
         assert(is_pow2(new_limit));
 
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
         limit = new_limit;
         memset(bitmap, 0, bitmap_size);
 
-        size_t i = 0;
-        for (data_type *v = old_data; v != old_data + old_limit; v++, i++) {
-            if ((bitmap_get(old_bitmap, i) & occupied) != occupied) continue;
-            for (size_t j = key_index(v->first); ; j = (j+1) & index_mask()) {
-                if ((bitmap_get(bitmap, j) & occupied) != occupied) {
-                    bitmap_set(bitmap, j, occupied);
-                    new (&data[j]) data_type();
-                    data[j] = /* copy */ *v;
-                    break;
+        size_t threads = resize_threads(old_limit, new_limit);
+        if (threads > 1) {
+            parallel_resize_internal(old_data, old_bitmap, old_limit, threads);
+        } else {
+            bitmap_foreach(old_bitmap, old_limit, [&](size_t i) {
+                uint64_t h = resize_hash(old_data, old_bitmap, old_limit, i);
+                size_t j = Policy::robin_hood ? place_internal(h, false) : free_internal(hash_index(h));
+                transfer_internal(old_data, old_limit, i, j, h);
+            });
+        }
+
+        tombs = 0;
+        deallocate_internal(old_data, old_limit);
+    }
+
+    /* the hash of the entry in slot i of the old table while resizing */
+    inline uint64_t resize_hash(data_type *old_data, uint64_t *old_bitmap,
+                                size_t old_limit, size_t i)
+    {
+        return Policy::store_hash ? hash_array(old_bitmap, old_limit)[i] :
+                                    key_hash(old_data[i].first);
+    }
+
+    /* moves the entry in slot i of the old table to free slot j */
+    inline void transfer_internal(data_type *old_data, size_t old_limit,
+                                  size_t i, size_t j, uint64_t h)
+    {
+        bitmap_set(bitmap, j, occupied);
+        fingerprint_set(j, h);
+        hash_store(j, h);
+        relocate(&data[j], old_data + i);
+        if constexpr (Policy::split_values) {
+            relocate(&values()[j], &value_array(old_data, old_limit)[i]);
+        }
+    }
+
+    /*
+     * parallel resize splits the old table into one power of two range
+     * of slots per thread, each at least resize_grain slots. an entry
+     * with its home in a range has its new home in the same range of
+     * one of the copies of the old table that make up the new table, so
+     * each thread places the entries of its range with linear probing
+     * confined to its ranges in the new table, which share no bitmap
+     * words with other threads. entries displaced into a range from the
+     * one before it, and entries whose probe would cross the end of a
+     * range, are deferred and placed on the calling thread after the
+     * threads join. robin hood tables and shrinking resize serially.
+     */
+
+    /* the number of threads to resize from old_limit to new_limit slots */
+    static size_t resize_threads(size_t old_limit, size_t new_limit)
+    {
+        if constexpr (Policy::parallel_resize == 0 || Policy::robin_hood) {
+            return 1;
+        } else {
+            if (old_limit < Policy::parallel_resize || new_limit < old_limit) return 1;
+            size_t n = Policy::resize_threads ? Policy::resize_threads :
+                                                std::thread::hardware_concurrency();
+            size_t max = old_limit / resize_grain;
+            if (n > max) n = max;
+            return n < 2 ? 1 : std::bit_floor(n);
+        }
+    }
+
+    /* returns the first free slot from slot i before slot end, which
+     * is a multiple of 32, or end if the slots are all in use */
+    size_t free_range_internal(size_t i, size_t end)
+    {
+        while (i < end) {
+            size_t n = bitmap_span(i);
+            uint64_t free = bitmap_free(bitmap_word(bitmap, i)) & bitmap_mask(n);
+            if (free) return i + bitmap_ctz(free);
+            i += n;
+        }
+        return end;
+    }
+
+    void parallel_resize_internal(data_type *old_data, uint64_t *old_bitmap,
+                                  size_t old_limit, size_t threads)
+    {
+        size_t span = old_limit / threads;
+        std::vector<std::vector<std::pair<size_t,uint64_t>>> deferred(threads);
+
+        auto migrate = [&](size_t t) {
+            size_t start = t * span, end = start + span;
+            for (size_t i = start; i < end; i += 32) {
+                uint64_t occ = bitmap_occupied(old_bitmap[bitmap_idx(i)]) & bitmap_even;
+                for (; occ; occ &= occ - 1) {
+                    size_t k = i + bitmap_ctz(occ);
+                    uint64_t h = resize_hash(old_data, old_bitmap, old_limit, k);
+                    size_t home = h & (old_limit - 1);
+                    size_t j = hash_index(h), seam = (j | (span - 1)) + 1;
+                    if (home >= start && home < end) j = free_range_internal(j, seam);
+                    else j = seam;
+                    if (j == seam) deferred[t].emplace_back(k, h);
+                    else transfer_internal(old_data, old_limit, k, j, h);
                 }
             }
+        };
+
+        /* a range whose thread cannot be started migrates here instead */
+        std::vector<std::thread> pool;
+        for (size_t t = 1; t < threads; t++) {
+            try {
+                pool.emplace_back(migrate, t);
+            } catch (const std::system_error &) {
+                migrate(t);
+            }
         }
+        migrate(0);
+        for (auto &thread : pool) thread.join();
 
-        tombs = 0;
-        for (size_t i = 0; i < old_limit; i++) {
-            if ((bitmap_get(old_bitmap, i) & occupied) == occupied) {
-                old_data[i].~data_type();
+        for (auto &list : deferred) {
+            for (auto [i, h] : list) {
+                transfer_internal(old_data, old_limit, i, free_internal(hash_index(h)), h);
             }
         }
-        free(old_data);
     }
 
-    void clear()
+    /* exchanges the entries in slots i and j */
+    void swap_internal(size_t i, size_t j)
     {
+        alignas(data_type) char t[sizeof(data_type)];
+        relocate((data_type*)t, &data[i]);
+        relocate(&data[i], &data[j]);
+        relocate(&data[j], (data_type*)t);
+        if constexpr (Policy::split_values) {
+            alignas(Value) char u[sizeof(Value)];
+            relocate((Value*)u, &values()[i]);
+            relocate(&values()[i], &values()[j]);
+            relocate(&values()[j], (Value*)u);
+        }
+    }
+
+    /*
+     * rehashes the table in place at the same capacity, dropping the
+     * tombstones. occupied slots are first marked recycled, which means
+     * not yet placed, and deleted slots become available. each recycled
+     * entry then moves to the first unplaced slot of its probe sequence,
+     * which is either available, or recycled in which case the entries
+     * are exchanged and the displaced entry is placed next. returns the
+     * new slot of the entry that was in slot track.
+     */
+    size_t purge_internal(size_t track = size_t(-1))
+    {
+        for (size_t i = 0; i < limit; i += 32) {
+            uint64_t occ = bitmap[bitmap_idx(i)] & bitmap_even;
+            bitmap[bitmap_idx(i)] = occ | (occ << 1);
+        }
         for (size_t i = 0; i < limit; i++) {
-            if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                data[i].~data_type();
+            while (bitmap_get(bitmap, i) == recycled) {
+                uint64_t h = slot_hash(i);
+                size_t j = unplaced_internal(hash_index(h));
+                if (j == i) {
+                    bitmap_clear(bitmap, i, deleted);
+                } else if (bitmap_get(bitmap, j) == available) {
+                    relocate_internal(j, i);
+                    bitmap_set(bitmap, j, occupied);
+                    bitmap_clear(bitmap, i, recycled);
+                    if (track == i) track = j;
+                } else {
+                    swap_internal(i, j);
+                    if constexpr (Policy::store_hash) hashes()[i] = hashes()[j];
+                    bitmap_clear(bitmap, j, deleted);
+                    if (track == i) track = j;
+                    else if (track == j) track = i;
+                }
+                fingerprint_set(j, h);
+                hash_store(j, h);
+            }
+        }
+        tombs = 0;
+        return track;
+    }
+
+    /* prefetches the bitmap word, metadata and entry of slot i */
+    void prefetch_internal(size_t i)
+    {
+        hash_prefetch(bitmap + bitmap_idx(i));
+        if constexpr (Policy::fingerprint) hash_prefetch(fingerprints() + i);
+        if constexpr (Policy::robin_hood) hash_prefetch(displacements() + i);
+        if constexpr (Policy::store_hash) hash_prefetch(hashes() + i);
+        hash_prefetch(data + i);
+    }
+
+    /* returns the first free slot in the probe sequence from slot i */
+    size_t free_internal(size_t i)
+    {
+        for (;;) {
+            size_t n = bitmap_span(i);
+            uint64_t m = bitmap_mask(n);
+            uint64_t free = bitmap_free(bitmap_word(bitmap, i)) & m;
+            if (free) return i + bitmap_ctz(free);
+            i = (i + n) & index_mask();
+        }
+    }
+
+    /* returns the first available or recycled slot in the probe sequence
+     * from slot i, which is the first slot not yet placed while purging */
+    size_t unplaced_internal(size_t i)
+    {
+        for (;;) {
+            size_t n = bitmap_span(i);
+            uint64_t m = bitmap_mask(n);
+            uint64_t unplaced = bitmap_unplaced(bitmap_word(bitmap, i)) & m;
+            if (unplaced) return i + bitmap_ctz(unplaced);
+            i = (i + n) & index_mask();
+        }
+    }
+
+    /* makes room for an entry with hash h at its robin hood slot by
+     * shifting the rest of the cluster forward one slot, and returns
+     * the slot. if grow is set and a displacement would saturate, the
+     * table doubles once when it is over half its load factor. a long
+     * cluster in a sparser table comes from equal hashes, which growth
+     * does not separate, so the displacements saturate instead */
+    size_t place_internal(uint64_t h, bool grow = true)
+    {
+        for (;;) {
+            uint8_t *disp = displacements();
+            size_t i = hash_index(h), d = 0;
+            while (disp[i] > d || (disp[i] == displacement_max && displacement(i) >= d)) {
+                i = (i + 1) & index_mask();
+                d++;
+            }
+            size_t e = free_internal(i);
+            bool fits = d + 1 < displacement_max;
+            for (size_t k = i; fits && k != e; k = (k + 1) & index_mask()) {
+                fits = disp[k] + 1u < displacement_max;
             }
+            if (!fits && grow && load() * 2 > max_load) {
+                resize_internal(data, bitmap, limit, limit << 1);
+                grow = false;
+                continue;
+            }
+            for (size_t k = e; k != i; ) {
+                size_t j = (k - 1) & index_mask();
+                relocate_internal(k, j);
+                disp[k] = disp[j] < displacement_max ? disp[j] + 1 : displacement_max;
+                if constexpr (Policy::fingerprint) fingerprints()[k] = fingerprints()[j];
+                if constexpr (Policy::store_hash) hashes()[k] = hashes()[j];
+                k = j;
+            }
+            if (e != i) bitmap_set(bitmap, e, occupied);
+            disp[i] = displacement_byte(d);
+            return i;
         }
-        size_t bitmap_size = bitmap_capacity(limit);
+    }
+
+    /* returns the robin hood slot containing key with hash h, or the slot
+     * where it would be inserted with found set to false if not present */
+    size_t robin_hood_internal(const Key &key, uint64_t h, bool &found)
+    {
+        uint8_t *disp = displacements();
+        uint8_t tag = hash_fingerprint(h);
+        for (size_t i = hash_index(h), d = 0; ; i = (i + 1) & index_mask(), d++) {
+            if (disp[i] <= d && disp[i] < displacement_max) {
+                found = false;
+                return i;
+            }
+            if constexpr (Policy::fingerprint) {
+                if (fingerprints()[i] != tag) continue;
+            }
+            if (hash_match(i, h) && _compare(data[i].first, key)) {
+                found = true;
+                return i;
+            }
+        }
+    }
+
+    /* returns the slot containing key or limit if key is not present */
+    size_t find_internal(const Key &key)
+    {
+        return find_internal(key, key_hash(key));
+    }
+
+    size_t find_internal(const Key &key, uint64_t h)
+    {
+        if constexpr (Policy::robin_hood) {
+            bool found;
+            size_t i = robin_hood_internal(key, h, found);
+            return found ? i : limit;
+        }
+        uint8_t tag = hash_fingerprint(h);
+        for (size_t i = hash_index(h); ; ) {
+            size_t n = bitmap_span(i);
+            uint64_t w = bitmap_word(bitmap, i), m = bitmap_mask(n);
+            uint64_t avail = bitmap_available(w) & m;
+            uint64_t occ = bitmap_occupied(w) & m & bitmap_below(avail);
+            if constexpr (Policy::fingerprint) occ &= fingerprint_mask(i, tag);
+            for (; occ; occ &= occ - 1) {
+                size_t j = i + bitmap_ctz(occ);
+                if (hash_match(j, h) && _compare(data[j].first, key)) return j;
+            }
+            if (avail) return limit;
+            i = (i + n) & index_mask();
+        }
+    }
+
+    /* returns the slot containing key with hash h, or the first free slot
+     * in its probe sequence with found set to false if key is not present */
+    size_t probe_internal(const Key &key, uint64_t h, bool &found)
+    {
+        if constexpr (Policy::robin_hood) return robin_hood_internal(key, h, found);
+        size_t slot = limit;
+        uint8_t tag = hash_fingerprint(h);
+        for (size_t i = hash_index(h); ; ) {
+            size_t n = bitmap_span(i);
+            uint64_t w = bitmap_word(bitmap, i), m = bitmap_mask(n);
+            uint64_t avail = bitmap_available(w) & m;
+            uint64_t occ = bitmap_occupied(w) & m & bitmap_below(avail);
+            if constexpr (Policy::fingerprint) occ &= fingerprint_mask(i, tag);
+            uint64_t free = bitmap_free(w) & m;
+            if (slot == limit && free) slot = i + bitmap_ctz(free);
+            for (; occ; occ &= occ - 1) {
+                size_t j = i + bitmap_ctz(occ);
+                if (hash_match(j, h) && _compare(data[j].first, key)) {
+                    found = true;
+                    return j;
+                }
+            }
+            if (avail) {
+                found = false;
+                return slot;
+            }
+            i = (i + n) & index_mask();
+        }
+    }
+
+    /* marks free slot i occupied for hash h, growing the table if the new
+     * entry exceeds the load factor, and returns the slot to construct */
+    size_t claim_internal(uint64_t h, size_t i)
+    {
+        if (bitmap_get(bitmap, i) == deleted) tombs--;
+        used++;
+        if (load() > max_load) {
+            if (purge_due()) purge_internal();
+            else resize_internal(data, bitmap, limit, limit << 1);
+            i = free_internal(hash_index(h));
+        }
+        if constexpr (Policy::robin_hood) i = place_internal(h);
+        bitmap_set(bitmap, i, occupied);
+        fingerprint_set(i, h);
+        hash_store(i, h);
+        return i;
+    }
+
+    /* returns the slot for key and false if present, otherwise claims a
+     * slot, constructs the entry from key and args, and returns true.
+     * args are only consumed when the entry is inserted */
+    template <typename K, typename... Args>
+    std::pair<size_t,bool> emplace_internal(K &&key, Args&&... args)
+    {
+        uint64_t h = key_hash(key);
+        return emplace_hash_internal(h, std::forward<K>(key), std::forward<Args>(args)...);
+    }
+
+    /* emplace_internal for a key whose hash h is already known */
+    template <typename K, typename... Args>
+    std::pair<size_t,bool> emplace_hash_internal(uint64_t h, K &&key, Args&&... args)
+    {
+        bool found;
+        size_t i = probe_internal(key, h, found);
+        if (found) return { i, false };
+        return { construct_internal(h, i, std::forward<K>(key), std::forward<Args>(args)...), true };
+    }
+
+    /* claims free slot i from probe_internal for an absent key with hash
+     * h, constructs the entry from key and args, and returns its slot */
+    template <typename K, typename... Args>
+    size_t construct_internal(uint64_t h, size_t i, K &&key, Args&&... args)
+    {
+        i = claim_internal(h, i);
+        new (&data[i].first) Key(std::forward<K>(key));
+        new (&slot_value(i)) Value(std::forward<Args>(args)...);
+        return i;
+    }
+
+    /*
+     * backward-shift deletion: the entry in slot i has been destroyed.
+     * each following entry of the cluster that may live in the hole,
+     * because its home slot is not between the hole and itself, moves
+     * back into it and leaves a hole of its own. the last hole becomes
+     * available, so no tombstone is left behind. robin hood clusters are
+     * in home slot order, so entries shift back until one is at home.
+     */
+    void shift_internal(size_t i)
+    {
+        for (size_t j = (i + 1) & index_mask(); ; j = (j + 1) & index_mask()) {
+            if (!(bitmap_get(bitmap, j) & occupied)) break;
+            if constexpr (Policy::robin_hood) {
+                size_t d = displacement(j);
+                if (d == 0) break;
+                displacements()[i] = displacement_byte(d - 1);
+            } else {
+                size_t k = hash_index(slot_hash(j));
+                if (((j - k) & index_mask()) < ((j - i) & index_mask())) continue;
+            }
+            relocate_internal(i, j);
+            if constexpr (Policy::fingerprint) fingerprints()[i] = fingerprints()[j];
+            if constexpr (Policy::store_hash) hashes()[i] = hashes()[j];
+            i = j;
+        }
+        bitmap_clear(bitmap, i, recycled);
+        if constexpr (Policy::robin_hood) displacements()[i] = 0;
+    }
+
+    /* sets the load factor at which the table doubles, clamped to
+     * [0.0625, 0.9375] so that probes always find an available slot.
+     * f is clamped before conversion, and NaN takes the minimum */
+    void max_load_factor(float f)
+    {
+        float lo = (float)load_min / load_multiplier, hi = (float)load_max / load_multiplier;
+        f = !(f >= lo) ? lo : f > hi ? hi : f;
+        max_load = (size_t)(f * load_multiplier);
+        reserve(used);
+    }
+
+    /* sets the capacity to hold at least n entries without growing */
+    void reserve(size_t n)
+    {
+        size_t new_limit = capacity_for(n, max_load);
+        if (new_limit > limit) {
+            resize_internal(data, bitmap, limit, new_limit);
+        }
+    }
+
+    /* rebuilds the table with at least count slots, or more if needed
+     * for the current size, which may shrink it and drops tombstones.
+     * the table keeps min_size slots so the bitmap stays word aligned */
+    void rehash(size_t count)
+    {
+        size_t new_limit = std::bit_ceil(count);
+        size_t min_limit = capacity_for(used, max_load);
+        if (new_limit < min_limit) new_limit = min_limit;
+        if (new_limit < inline_capacity) new_limit = inline_capacity;
+        if (new_limit != limit) {
+            resize_internal(data, bitmap, limit, new_limit);
+        } else if (tombs) {
+            purge_internal();
+        }
+    }
+
+    /* drops tombstones in place without changing the capacity */
+    void purge()
+    {
+        if (tombs) purge_internal();
+    }
+
+    /* shrinks the capacity to the smallest that holds the current size */
+    void shrink_to_fit() { rehash(0); }
+
+    void clear()
+    {
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            destroy_internal(i);
+        });
+        size_t bitmap_size = metadata_capacity(limit);
         memset(bitmap, 0, bitmap_size);
         used = tombs = 0;
     }
 
     iterator insert(iterator i, const value_type& val) { return insert(val); }
-    iterator insert(Key key, Value val) { return insert(value_type(key, val)); }
+    iterator insert(iterator i, value_type&& val) { return insert(std::move(val)); }
+    iterator insert(Key key, Value val) { return insert(value_type(std::move(key), std::move(val))); }
 
+    /* inserts v or assigns its value to the existing entry for its key */
     iterator insert(const value_type& v)
     {
-        for (size_t i = key_index(v.first); ; i = (i+1) & index_mask()) {
-            bitmap_state state = bitmap_get(bitmap, i);
-            if ((state & recycled) == available) {
-                bitmap_set(bitmap, i, occupied);
-                new (&data[i]) data_type();
-                data[i] = /* copy */ data_type{v.first, v.second};
-                used++;
-                if ((state & deleted) == deleted) tombs--;
-                if (load() > load_factor) {
-                    resize_internal(data, bitmap, limit, limit << 1);
-                    for (i = key_index(v.first); ; i = (i+1) & index_mask()) {
-                        bitmap_state state = bitmap_get(bitmap, i);
-                             if (state == available) abort();
-                        else if (state == deleted); /* skip */
-                        else if (_compare(data[i].first, v.first)) {
-                            return iterator{this, i};
-                        }
-                    }
-                } else {
-                    return iterator{this, i};
-                }
-            } else if (_compare(data[i].first, v.first)) {
-                data[i].second = /* copy */ v.second;
-                return iterator{this, i};
-            }
+        auto r = emplace_internal(v.first, v.second);
+        if (!r.second) slot_value(r.first) = /* copy */ v.second;
+        return iterator{this, r.first};
+    }
+
+    iterator insert(value_type&& v)
+    {
+        auto r = emplace_internal(std::move(v.first), std::move(v.second));
+        if (!r.second) slot_value(r.first) = std::move(v.second);
+        return iterator{this, r.first};
+    }
+
+    /* inserts or assigns each entry of the range. a forward range sizes
+     * the table once up front, so the inserts never grow the table */
+    template <std::input_iterator It>
+    void insert(It first, It last)
+    {
+        if constexpr (std::forward_iterator<It>) {
+            reserve(used + (size_t)std::distance(first, last));
+            insert_batch_internal(first, last);
+        } else {
+            for (; first != last; ++first) insert(*first);
         }
     }
 
+    /* constructs value_type from args and inserts it if the key is absent */
+    template <typename... Args>
+    std::pair<iterator,bool> emplace(Args&&... args)
+    {
+        value_type v(std::forward<Args>(args)...);
+        auto r = emplace_internal(std::move(v.first), std::move(v.second));
+        return { iterator{this, r.first}, r.second };
+    }
+
+    /* constructs the value in place from args if the key is absent */
+    template <typename... Args>
+    std::pair<iterator,bool> try_emplace(const Key &key, Args&&... args)
+    {
+        auto r = emplace_internal(key, std::forward<Args>(args)...);
+        return { iterator{this, r.first}, r.second };
+    }
+
+    template <typename... Args>
+    std::pair<iterator,bool> try_emplace(Key &&key, Args&&... args)
+    {
+        auto r = emplace_internal(std::move(key), std::forward<Args>(args)...);
+        return { iterator{this, r.first}, r.second };
+    }
+
+    /* inserts a value constructed from obj or assigns obj if present */
+    template <typename M>
+    std::pair<iterator,bool> insert_or_assign(const Key &key, M&& obj)
+    {
+        auto r = emplace_internal(key, std::forward<M>(obj));
+        if (!r.second) slot_value(r.first) = std::forward<M>(obj);
+        return { iterator{this, r.first}, r.second };
+    }
+
+    template <typename M>
+    std::pair<iterator,bool> insert_or_assign(Key &&key, M&& obj)
+    {
+        auto r = emplace_internal(std::move(key), std::forward<M>(obj));
+        if (!r.second) slot_value(r.first) = std::forward<M>(obj);
+        return { iterator{this, r.first}, r.second };
+    }
+
     Value& operator[](const Key &key)
     {
-        for (size_t i = key_index(key); ; i = (i+1) & index_mask()) {
-            bitmap_state state = bitmap_get(bitmap, i);
-            if ((state & recycled) == available) {
-                bitmap_set(bitmap, i, occupied);
-                new (&data[i]) data_type();
-                data[i].first = /* copy */ key;
-                used++;
-                if ((state & deleted) == deleted) tombs--;
-                if (load() > load_factor) {
-                    resize_internal(data, bitmap, limit, limit << 1);
-                    for (i = key_index(key);; i = (i+1) & index_mask()) {
-                        bitmap_state state = bitmap_get(bitmap, i);
-                             if (state == available) abort();
-                        else if (state == deleted); /* skip */
-                        else if (_compare(data[i].first, key)) {
-                            return data[i].second;
-                        }
-                    }
-                }
-                return data[i].second;
-            } else if (_compare(data[i].first, key)) {
-                return data[i].second;
+        size_t i = emplace_internal(key).first;
+        return slot_value(i);
+    }
+
+    Value& operator[](Key &&key)
+    {
+        size_t i = emplace_internal(std::move(key)).first;
+        return slot_value(i);
+    }
+
+    /*
+     * looks up n keys in groups of prefetch_batch. each group is hashed
+     * and the home slots prefetched before any is probed, so the cache
+     * misses of the group overlap instead of being taken one at a time.
+     */
+    template <typename F>
+    void find_batch_internal(const Key *keys, size_t n, F fn)
+    {
+        uint64_t h[prefetch_batch];
+        for (size_t b = 0; b < n; b += prefetch_batch) {
+            size_t m = n - b < prefetch_batch ? n - b : prefetch_batch;
+            for (size_t k = 0; k < m; k++) {
+                h[k] = key_hash(keys[b + k]);
+                prefetch_internal(hash_index(h[k]));
+            }
+            for (size_t k = 0; k < m; k++) {
+                fn(b + k, find_internal(keys[b + k], h[k]));
             }
         }
     }
 
-    iterator find(const Key &key)
+    /* inserts a forward range in groups of prefetch_batch entries. the
+     * home slots of a group are hashed and prefetched before any entry
+     * of the group is inserted, so the misses on a large table overlap */
+    template <std::forward_iterator It>
+    void insert_batch_internal(It first, It last)
     {
-        for (size_t i = key_index(key); ; i = (i+1) & index_mask()) {
-            bitmap_state state = bitmap_get(bitmap, i);
-                 if (state == available)           /* notfound */ break;
-            else if (state == deleted);            /* skip */
-            else if (_compare(data[i].first, key)) return iterator{this, i};
+        uint64_t h[prefetch_batch];
+        while (first != last) {
+            It group = first;
+            size_t m = 0;
+            for (; m < prefetch_batch && first != last; ++first, m++) {
+                h[m] = key_hash((*first).first);
+                prefetch_internal(hash_index(h[m]));
+            }
+            for (size_t k = 0; k < m; ++group, k++) {
+                auto &&v = *group;
+                auto r = emplace_hash_internal(h[k],
+                    std::forward<decltype(v)>(v).first, std::forward<decltype(v)>(v).second);
+                if (!r.second) slot_value(r.first) = std::forward<decltype(v)>(v).second;
+            }
         }
-        return end();
+    }
+
+    /* sets out[k] to the iterator for keys[k] or end() for k < n */
+    void find_many(const Key *keys, size_t n, iterator *out)
+    {
+        find_batch_internal(keys, n, [&](size_t k, size_t i) {
+            out[k] = iterator{this, i};
+        });
+    }
+
+    /* sets out[k] to whether keys[k] is present for k < n */
+    void contains_many(const Key *keys, size_t n, bool *out)
+    {
+        find_batch_internal(keys, n, [&](size_t k, size_t i) {
+            out[k] = i != limit;
+        });
+    }
+
+    iterator find(const Key &key)
+    {
+        return iterator{this, find_internal(key)};
     }
 
     void erase(Key key)
     {
-        for (size_t i = key_index(key); ; i = (i+1) & index_mask()) {
-            bitmap_state state = bitmap_get(bitmap, i);
-                 if (state == available)           /* notfound */ break;
-            else if (state == deleted);            /* skip */
-            else if (_compare(data[i].first, key)) {
-                bitmap_set(bitmap, i, deleted);
-                data[i].~data_type();
-                bitmap_clear(bitmap, i, occupied);
-                used--;
-                tombs++;
-                return;
-            }
+        size_t i = find_internal(key);
+        if (i != limit) erase_internal(i);
+    }
+
+    /* erases the entry in slot i. with backward shifts a following
+     * entry of the cluster may move into slot i */
+    void erase_internal(size_t i)
+    {
+        if constexpr (Policy::backward_shift || Policy::robin_hood) {
+            destroy_internal(i);
+            shift_internal(i);
+            used--;
+        } else {
+            bitmap_set(bitmap, i, deleted);
+            destroy_internal(i);
+            bitmap_clear(bitmap, i, occupied);
+            used--;
+            tombs++;
         }
     }
 
@@ -389,4 +1348,11 @@ struct hash_map
     bool operator!=(const hash_map &o) const { return !(*this == o); }
 };
 
+template <class Key, class Value, class Hash, class Pred, class Policy, class Allocator>
+struct is_trivially_relocatable<hash_map<Key,Value,Hash,Pred,Policy,Allocator>>
+    : std::bool_constant<Policy::inline_capacity == 0 &&
+                         is_trivially_relocatable<Allocator>::value &&
+                         is_trivially_relocatable<Hash>::value &&
+                         is_trivially_relocatable<Pred>::value> {};
+
 };
\ No newline at end of file
@@ -0,0 +1,297 @@
+/*
+ * Open addressing hash table with incremental resizing.
+ *
+ * Copyright (c) 2020 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+#include <utility>
+#include <functional>
+#include <memory>
+#include <optional>
+
+#include "hash_map.h"
+
+namespace ethical {
+
+/*
+ * incremental_hash_map is a hash_map for latency sensitive use that
+ * never rehashes the whole table in one operation. when an insert
+ * would exceed the load factor, the table becomes the old table and
+ * an empty table of twice the capacity, or the same capacity if most
+ * of the load is tombstones, takes its place. each insert and erase
+ * then migrates the entries of the next step slots of the old table,
+ * so growth costs an allocation and a bounded amount of work per
+ * operation instead of a pause proportional to the table size.
+ *
+ * every key is in exactly one of the tables. lookups probe the new
+ * table and then the old table while a migration is in progress, and
+ * inserts find keys that have not yet migrated in the old table. a
+ * migrated entry is erased from the old table, so slots before the
+ * migration cursor are empty and a backward shift never moves an
+ * entry behind the cursor.
+ *
+ * each operation adds at most one entry or tombstone to the new table,
+ * so the step is the old slot count divided by the room left in the
+ * new table after the migrated entries, and at least migrate_step.
+ * the migration then completes before the new table is due to grow.
+ * the room is a fixed fraction of the slot count for a given load
+ * factor and purge_factor, so the step does not grow with the table.
+ */
+
+template <class Key, class Value,
+          class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>,
+          class Policy = hash_policy,
+          class Allocator = std::allocator<std::pair<const Key, Value>>>
+struct incremental_hash_map
+{
+    static const size_t migrate_step = (2<<5); /* 64 */
+
+    typedef hash_map<Key,Value,Hash,Pred,Policy,Allocator> map_type;
+
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<Key, Value> value_type;
+    typedef Hash hasher;
+    typedef Pred key_equal;
+    typedef Policy policy_type;
+    typedef Allocator allocator_type;
+    typedef typename map_type::reference reference;
+
+    map_type table;
+    std::optional<map_type> old;
+    size_t cursor;
+    size_t step;
+
+    /*
+     * iterator visiting the entries left in the old table and then
+     * the entries of the new table
+     */
+
+    struct iterator
+    {
+        incremental_hash_map *m;
+        typename map_type::iterator i;
+
+        void settle() { if (m->old && i == m->old->end()) i = m->table.begin(); }
+        iterator& operator++() { ++i; settle(); return *this; }
+        iterator operator++(int) { iterator r = *this; ++(*this); return r; }
+        reference operator*() { return *i; }
+        auto operator->() { return i.operator->(); }
+        bool operator==(const iterator &o) const { return i == o.i; }
+        bool operator!=(const iterator &o) const { return i != o.i; }
+    };
+
+    /*
+     * constructors
+     */
+
+    /* there is no old table between migrations */
+    inline incremental_hash_map() : incremental_hash_map(map_type::default_size) {}
+    explicit inline incremental_hash_map(const Allocator &alloc) :
+        incremental_hash_map(map_type::default_size, Hash(), Pred(), alloc) {}
+    inline incremental_hash_map(size_t initial_size, const Hash &hash = Hash(),
+                                const Pred &pred = Pred(),
+                                const Allocator &alloc = Allocator()) :
+        table(initial_size, hash, pred, alloc), cursor(0), step(migrate_step) {}
+
+    /*
+     * member functions
+     */
+
+    inline size_t size() { return table.size() + (old ? old->size() : 0); }
+    inline bool empty() { return size() == 0; }
+    inline size_t capacity() { return table.capacity(); }
+    inline bool migrating() { return old.has_value(); }
+    inline uint64_t key_hash(const Key &key) { return table.key_hash(key); }
+    inline hasher hash_function() const { return table.hash_function(); }
+    inline key_equal key_eq() const { return table.key_eq(); }
+    inline allocator_type get_allocator() const { return table.get_allocator(); }
+
+    inline iterator begin()
+    {
+        if (!old) return iterator{ this, table.begin() };
+        iterator r{ this, old->begin() };
+        r.settle();
+        return r;
+    }
+    inline iterator end() { return iterator{ this, table.end() }; }
+
+    /* true if one more entry would take the table past its load factor */
+    inline bool grow_due()
+    {
+        return (table.used + table.tombs + 1) * map_type::load_multiplier /
+            table.limit > table.max_load;
+    }
+
+    /* makes the table the old table and starts migrating it to a new
+     * table, with a step that finishes the migration in fewer inserts
+     * than the new table has room for after the migrated entries */
+    void grow_internal()
+    {
+        assert(!migrating());
+        size_t new_limit = table.purge_due() ? table.limit : table.limit << 1;
+        old.emplace(std::move(table));
+        table = map_type(new_limit, old->hash_function(), old->key_eq(), old->get_allocator());
+        table.max_load = old->max_load;
+        size_t fill = new_limit * table.max_load / map_type::load_multiplier;
+        size_t room = fill > old->used ? fill - old->used : 0;
+        step = room ? (old->limit + room - 1) / room : old->limit;
+        if (step < migrate_step) step = migrate_step;
+        cursor = 0;
+    }
+
+    /* migrates the entries of up to n slots of the old table to the new
+     * table, returning true while the migration is in progress. a shift
+     * may move a following entry into the slot just erased, so the
+     * cursor stays on a slot until it is empty */
+    bool migrate(size_t n)
+    {
+        if (!old) return false;
+        size_t end = n < old->limit - cursor ? cursor + n : old->limit;
+        size_t i;
+        while ((i = old->bitmap_next(cursor)) < end) {
+            table.emplace_hash_internal(old->slot_hash(i), std::move(old->data[i].first),
+                                        std::move(old->slot_value(i)));
+            old->erase_internal(i);
+            cursor = i;
+        }
+        cursor = end;
+        if (cursor == old->limit) old.reset();
+        return migrating();
+    }
+
+    /* sets i to the slot of key with hash h in the old table, returning
+     * false if key is not there or no migration is in progress */
+    bool find_old_internal(const Key &key, uint64_t h, size_t &i)
+    {
+        if (!old) return false;
+        i = old->find_internal(key, h);
+        return i != old->limit;
+    }
+
+    iterator find(const Key &key)
+    {
+        uint64_t h = key_hash(key);
+        size_t i = table.find_internal(key, h);
+        if (i != table.limit) return iterator{ this, { &table, i } };
+        if (find_old_internal(key, h, i)) return iterator{ this, { &*old, i } };
+        return end();
+    }
+
+    bool contains(const Key &key) { return find(key) != end(); }
+
+    /* steps the migration, then returns the entry for key and false if
+     * present in either table, otherwise constructs the entry from key
+     * and args in the new table, starting a migration if it is due,
+     * and returns true */
+    template <typename K, typename... Args>
+    std::pair<iterator,bool> emplace_internal(K &&key, Args&&... args)
+    {
+        uint64_t h = key_hash(key);
+        migrate(step);
+        bool found;
+        size_t i = table.probe_internal(key, h, found);
+        if (found) return { iterator{ this, { &table, i } }, false };
+        size_t j;
+        if (find_old_internal(key, h, j)) return { iterator{ this, { &*old, j } }, false };
+        if (grow_due()) {
+            grow_internal();
+            i = table.probe_internal(key, h, found);
+        }
+        i = table.construct_internal(h, i, std::forward<K>(key), std::forward<Args>(args)...);
+        return { iterator{ this, { &table, i } }, true };
+    }
+
+    /* inserts the entry or assigns val to the existing entry for key */
+    iterator insert(Key key, Value val)
+    {
+        return insert_or_assign(std::move(key), std::move(val)).first;
+    }
+
+    /* constructs the value in place from args if the key is absent */
+    template <typename... Args>
+    std::pair<iterator,bool> try_emplace(const Key &key, Args&&... args)
+    {
+        return emplace_internal(key, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    std::pair<iterator,bool> try_emplace(Key &&key, Args&&... args)
+    {
+        return emplace_internal(std::move(key), std::forward<Args>(args)...);
+    }
+
+    /* inserts a value constructed from obj or assigns obj if present */
+    template <typename M>
+    std::pair<iterator,bool> insert_or_assign(const Key &key, M&& obj)
+    {
+        auto r = emplace_internal(key, std::forward<M>(obj));
+        if (!r.second) r.first->second = std::forward<M>(obj);
+        return r;
+    }
+
+    template <typename M>
+    std::pair<iterator,bool> insert_or_assign(Key &&key, M&& obj)
+    {
+        auto r = emplace_internal(std::move(key), std::forward<M>(obj));
+        if (!r.second) r.first->second = std::forward<M>(obj);
+        return r;
+    }
+
+    Value& operator[](const Key &key)
+    {
+        return emplace_internal(key).first->second;
+    }
+
+    Value& operator[](Key &&key)
+    {
+        return emplace_internal(std::move(key)).first->second;
+    }
+
+    void erase(const Key &key)
+    {
+        uint64_t h = key_hash(key);
+        migrate(step);
+        size_t i = table.find_internal(key, h);
+        if (i != table.limit) {
+            table.erase_internal(i);
+        } else if (find_old_internal(key, h, i)) {
+            old->erase_internal(i);
+        }
+    }
+
+    /* sets the capacity to hold at least n entries without growing,
+     * finishing a migration in progress and resizing in one step */
+    void reserve(size_t n)
+    {
+        if (old) migrate(old->limit);
+        table.reserve(n);
+    }
+
+    void clear()
+    {
+        table.clear();
+        old.reset();
+    }
+};
+
+};
\ No newline at end of file
@@ -24,8 +24,14 @@
 #include <cstddef>
 #include <cassert>
 
+#include <bit>
 #include <utility>
+#include <iterator>
 #include <functional>
+#include <memory>
+#include <initializer_list>
+
+#include "hash_common.h"
 
 namespace ethical {
 
@@ -33,7 +39,8 @@ namespace ethical {
  * This open addressing linked_hash_set uses a 2-bit entry per slot
  * bitmap that eliminates the need for empty and deleted key sentinels.
  * The hashmap has a simple array of key and value pairs and the
- * tombstone bitmap, which are allocated in a single call to malloc.
+ * tombstone bitmap, which are allocated as a single block from the
+ * Allocator, rebound to an aligned block type.
  *
  * The linked_hash_set entries contains a bidirectional linked list
  * for predictable iteration order based on order of insertion.
@@ -41,25 +48,72 @@ namespace ethical {
 
 template <class Key, class Offset = int32_t,
           class Hash = std::hash<Key>,
-          class Pred = std::equal_to<Key>>
+          class Pred = std::equal_to<Key>,
+          class Policy = hash_policy,
+          class Allocator = std::allocator<Key>>
 struct linked_hash_set
 {
     static const size_t default_size =    (2<<3);  /* 16 */
-    static const size_t load_factor =     (2<<15); /* 0.5 */
+    static const size_t min_size =        (2<<2);  /* 8 */
+    static const size_t prefetch_batch =  (2<<3);  /* 16 */
     static const size_t load_multiplier = (2<<16); /* 1.0 */
+    static const size_t load_factor =     (size_t)(Policy::max_load_factor * load_multiplier);
+    static const size_t load_min =        (2<<12); /* 0.0625 */
+    static const size_t load_max =        (2<<16) - (2<<12); /* 0.9375 */
+
+    static const size_t purge_factor =    (size_t)(Policy::purge_factor * load_multiplier);
+
+    static_assert(load_factor >= load_min && load_factor <= load_max,
+                  "max_load_factor must be between 0.0625 and 0.9375");
+    static_assert(purge_factor > 0 && purge_factor <= load_multiplier,
+                  "purge_factor must be greater than 0.0 and at most 1.0");
+    static_assert(!Policy::robin_hood,
+                  "robin_hood is not supported by the linked containers");
 
-    static inline Hash _hasher;
-    static inline Pred _compare;
+    static const bool relocatable =
+        is_trivially_relocatable<Key>::value;
 
-    struct data_type {
+    struct link_type {
+        Offset prev;
+        Offset next;
+    };
+
+    /* entries hold their links unless the policy splits them out */
+    struct linked_data_type {
         Key first;
         Offset prev;
         Offset next;
     };
+    struct split_data_type {
+        Key first;
+    };
+    typedef std::conditional_t<Policy::split_links,
+        split_data_type, linked_data_type> data_type;
+
+    /* the table is allocated in units of block_type, which is aligned
+     * for both the data array and the metadata words that follow it */
+    typedef hash_block<(alignof(data_type) > alignof(uint64_t) ?
+                        alignof(data_type) : alignof(uint64_t))> block_type;
+    typedef typename std::allocator_traits<Allocator>::template
+        rebind_alloc<block_type> block_allocator;
+    typedef std::allocator_traits<block_allocator> block_traits;
+    typedef hash_layout<Policy, Policy::split_links ? sizeof(link_type) : 0> layout;
+    typedef hash_data_layout<sizeof(data_type)> data_layout;
+
+    /* the first table of inline_capacity slots is stored in the object */
+    static const size_t inline_capacity = Policy::inline_capacity;
+    static const size_t inline_size = inline_capacity == 0 ? 0 :
+        data_layout::data_capacity(inline_capacity) + layout::metadata_capacity(inline_capacity);
+
+    static_assert(inline_capacity == 0 || std::has_single_bit(inline_capacity),
+                  "inline_capacity must be zero or a power of two");
 
     typedef Key value_type;
     typedef Hash hasher;
     typedef Pred key_equal;
+    typedef Policy policy_type;
+    typedef Allocator allocator_type;
+    typedef typename hash_mixer_for<typename Policy::mixer, Key>::type mixer_type;
     typedef Offset offset_type;
     typedef data_type& reference;
     typedef const data_type& const_reference;
@@ -69,10 +123,15 @@ struct linked_hash_set
     size_t used;
     size_t tombs;
     size_t limit;
+    size_t max_load;
     offset_type head;
     offset_type tail;
     data_type *data;
     uint64_t *bitmap;
+    [[no_unique_address]] Hash _hasher;
+    [[no_unique_address]] Pred _compare;
+    [[no_unique_address]] block_allocator _alloc;
+    [[no_unique_address]] hash_inline_storage<inline_size, alignof(block_type)> _inline;
 
     /*
      * scanning iterator
@@ -83,7 +142,7 @@ struct linked_hash_set
         linked_hash_set *h;
         size_t i;
 
-        iterator& operator++() { i = h->data[i].next; return *this; }
+        iterator& operator++() { i = h->link_next(i); return *this; }
         iterator operator++(int) { iterator r = *this; ++(*this); return r; }
         data_type& operator*() { return h->data[i]; }
         data_type* operator->() { return &h->data[i]; }
@@ -95,31 +154,41 @@ struct linked_hash_set
      * constructors and destructor
      */
 
-    inline linked_hash_set() : linked_hash_set(default_size) {}
-    inline linked_hash_set(size_t initial_size) :
-        used(0), tombs(0), limit(initial_size),
-        head(empty_offset), tail(empty_offset)
+    /* initial_size is a slot count, rounded up to a power of two */
+    inline linked_hash_set() : linked_hash_set(inline_capacity ? inline_capacity : default_size) {}
+    explicit inline linked_hash_set(const Allocator &alloc) :
+        linked_hash_set(inline_capacity ? inline_capacity : default_size, Hash(), Pred(), alloc) {}
+    inline linked_hash_set(size_t initial_size, const Hash &hash = Hash(),
+                           const Pred &pred = Pred(),
+                           const Allocator &alloc = Allocator()) :
+        used(0), tombs(0), limit(std::bit_ceil(initial_size < inline_capacity ? inline_capacity : initial_size)), max_load(load_factor),
+        head(empty_offset), tail(empty_offset), _hasher(hash), _compare(pred), _alloc(alloc)
     {
-        size_t data_size = sizeof(data_type) * limit;
-        size_t bitmap_size = bitmap_capacity(limit);
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
         size_t total_size = data_size + bitmap_size;
 
-        assert(is_pow2(initial_size));
-
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
         memset(bitmap, 0, bitmap_size);
     }
 
+    template <std::input_iterator It>
+    inline linked_hash_set(It first, It last) :
+        linked_hash_set(range_capacity(first, last))
+    {
+        insert(first, last);
+    }
+    inline linked_hash_set(std::initializer_list<value_type> l) :
+        linked_hash_set(l.begin(), l.end()) {}
+
     inline ~linked_hash_set()
     {
         if (data) {
-            for (size_t i = 0; i < limit; i++) {
-                if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                    data[i].~data_type();
-                }
-            }
-            free(data);
+            bitmap_foreach(bitmap, limit, [&](size_t i) {
+                data[i].~data_type();
+            });
+            deallocate_internal(data, limit);
         }
     }
 
@@ -128,69 +197,104 @@ struct linked_hash_set
      */
 
     inline linked_hash_set(const linked_hash_set &o) :
-        used(o.used), tombs(o.tombs), limit(o.limit),
-        head(o.head), tail(o.tail)
+        used(o.used), tombs(o.tombs), limit(o.limit), max_load(o.max_load),
+        head(o.head), tail(o.tail), _hasher(o._hasher), _compare(o._compare),
+        _alloc(block_traits::select_on_container_copy_construction(o._alloc))
     {
-        size_t data_size = sizeof(data_type) * limit;
-        size_t bitmap_size = bitmap_capacity(limit);
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
         size_t total_size = data_size + bitmap_size;
 
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
 
         memcpy(bitmap, o.bitmap, bitmap_size);
-        for (size_t i = 0; i < limit; i++) {
-            if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                data[i] = /* copy */ o.data[i];
-            }
-        }
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            new (&data[i]) data_type(/* copy */ o.data[i]);
+        });
     }
 
     inline linked_hash_set(linked_hash_set &&o) :
-        used(o.used), tombs(o.tombs), limit(o.limit),
+        used(o.used), tombs(o.tombs), limit(o.limit), max_load(o.max_load),
         head(o.head), tail(o.tail),
-        data(o.data), bitmap(o.bitmap)
+        data(o.data), bitmap(o.bitmap), _hasher(o._hasher), _compare(o._compare),
+        _alloc(o._alloc)
     {
-        o.data = nullptr;
-        o.bitmap = nullptr;
+        if (o.inline_internal()) {
+            move_internal(o);
+        } else {
+            o.data = nullptr;
+            o.bitmap = nullptr;
+        }
     }
 
     inline linked_hash_set& operator=(const linked_hash_set &o)
     {
-        free(data);
+        if (this == &o) return *this;
+
+        if (data) {
+            bitmap_foreach(bitmap, limit, [&](size_t i) {
+                data[i].~data_type();
+            });
+            deallocate_internal(data, limit);
+        }
 
         used = o.used;
         tombs = o.tombs;
         limit = o.limit;
+        max_load = o.max_load;
         head = o.head;
         tail = o.tail;
+        _hasher = o._hasher;
+        _compare = o._compare;
+        if constexpr (block_traits::propagate_on_container_copy_assignment::value) {
+            _alloc = o._alloc;
+        }
 
-        size_t data_size = sizeof(data_type) * limit;
-        size_t bitmap_size = bitmap_capacity(limit);
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
         size_t total_size = data_size + bitmap_size;
 
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
 
         memcpy(bitmap, o.bitmap, bitmap_size);
-        for (size_t i = 0; i < limit; i++) {
-            if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                data[i] = /* copy */ o.data[i];
-            }
-        }
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            new (&data[i]) data_type(/* copy */ o.data[i]);
+        });
 
         return *this;
     }
 
     inline linked_hash_set& operator=(linked_hash_set &&o)
     {
+        if (this == &o) return *this;
+
+        if (data) {
+            bitmap_foreach(bitmap, limit, [&](size_t i) {
+                data[i].~data_type();
+            });
+            deallocate_internal(data, limit);
+        }
+
+        if constexpr (block_traits::propagate_on_container_move_assignment::value) {
+            _alloc = o._alloc;
+        }
+        if (o.inline_internal() || _alloc != o._alloc) {
+            move_internal(o);
+            return *this;
+        }
+
         data = o.data;
         bitmap = o.bitmap;
         used = o.used;
         tombs = o.tombs;
         limit = o.limit;
+        max_load = o.max_load;
         head = o.head;
         tail = o.tail;
+        _hasher = o._hasher;
+        _compare = o._compare;
 
         o.data = nullptr;
         o.bitmap = nullptr;
@@ -205,10 +309,15 @@ struct linked_hash_set
     inline size_t size() { return used; }
     inline size_t capacity() { return limit; }
     inline size_t load() { return (used + tombs) * load_multiplier / limit; }
+    inline float max_load_factor() { return (float)max_load / load_multiplier; }
+    inline bool purge_due() { return tombs * load_multiplier >= purge_factor * (used + tombs); }
     inline size_t index_mask() { return limit - 1; }
     inline size_t hash_index(uint64_t h) { return h & index_mask(); }
-    inline size_t key_index(Key key) { return hash_index(_hasher(key)); }
+    inline uint64_t key_hash(const Key &key) { return mixer_type::mix(_hasher(key)); }
+    inline size_t key_index(const Key &key) { return hash_index(key_hash(key)); }
     inline hasher hash_function() const { return _hasher; }
+    inline key_equal key_eq() const { return _compare; }
+    inline allocator_type get_allocator() const { return allocator_type(_alloc); }
     inline iterator begin() { return iterator{ this, size_t(head) }; }
     inline iterator end() { return iterator{ this, size_t(empty_offset) }; }
 
@@ -221,7 +330,7 @@ struct linked_hash_set
     };
     static inline size_t bitmap_capacity(size_t limit)
     {
-        return (((limit + 3) >> 2) + 7) & ~7;
+        return layout::bitmap_capacity(limit);
     }
     static inline size_t bitmap_idx(size_t i) { return i >> 5; }
     static inline size_t bitmap_shift(size_t i) { return ((i << 1) & 63); }
@@ -239,53 +348,457 @@ struct linked_hash_set
     }
     static inline bool is_pow2(intptr_t n) { return  ((n & -n) == n); }
 
+    /* smallest power of two capacity holding n entries within max_load,
+     * and at least min_size */
+    static inline size_t capacity_for(size_t n, size_t max_load)
+    {
+        size_t l = std::bit_ceil(n < min_size ? min_size : n);
+        while (n * load_multiplier / l > max_load) l <<= 1;
+        return l;
+    }
+    template <std::input_iterator It>
+    static inline size_t range_capacity(It first, It last)
+    {
+        if constexpr (std::forward_iterator<It>) {
+            return capacity_for((size_t)std::distance(first, last), load_factor);
+        } else {
+            return default_size;
+        }
+    }
+
+    /*
+     * word-at-a-time helpers decode the states of up to 32 slots from
+     * one bitmap word. masks have one bit per slot at the even bit of
+     * each 2-bit entry so that slot offsets are recovered with ctz/2.
+     */
+
+    static const uint64_t bitmap_even = 0x5555555555555555ull;
+
+    static inline uint64_t bitmap_word(uint64_t *bitmap, size_t i)
+    {
+        return bitmap[bitmap_idx(i)] >> bitmap_shift(i);
+    }
+    static inline uint64_t bitmap_mask(size_t n)
+    {
+        return n < 32 ? bitmap_even & ((1ull << (n << 1)) - 1) : bitmap_even;
+    }
+    static inline uint64_t bitmap_occupied(uint64_t w) { return w; }
+    static inline uint64_t bitmap_available(uint64_t w) { return ~(w | (w >> 1)); }
+    static inline uint64_t bitmap_free(uint64_t w) { return ~w; }
+    static inline size_t bitmap_ctz(uint64_t m) { return std::countr_zero(m) >> 1; }
+    static inline uint64_t bitmap_below(uint64_t m) { return m ? (m & -m) - 1 : ~0ull; }
+    static inline uint64_t bitmap_unplaced(uint64_t w) { return ~(w ^ (w >> 1)); }
+
+    /* number of slots from i to the end of its bitmap word or the table */
+    inline size_t bitmap_span(size_t i)
+    {
+        size_t n = 32 - (i & 31);
+        return n < limit - i ? n : limit - i;
+    }
+
+    /*
+     * fingerprint helpers: one byte per slot after the bitmap, padded
+     * to a whole bitmap word so that 32 slots are compared at once.
+     */
+
+    static inline size_t fingerprint_capacity(size_t limit)
+    {
+        return layout::fingerprint_capacity(limit);
+    }
+    inline uint8_t* fingerprints()
+    {
+        return (uint8_t*)bitmap + bitmap_capacity(limit);
+    }
+    inline uint64_t fingerprint_mask(size_t i, uint8_t tag)
+    {
+        return fingerprint_match(fingerprints() + (i & ~31), tag) >> bitmap_shift(i);
+    }
+    inline void fingerprint_set(size_t i, uint64_t h)
+    {
+        if constexpr (Policy::fingerprint) fingerprints()[i] = hash_fingerprint(h);
+    }
+
+    /*
+     * stored hash helpers: the full hash of each entry is kept in a slot
+     * array after the other metadata, so that growth never calls the
+     * hasher and probes compare hashes before comparing keys.
+     */
+
+    static inline size_t hash_capacity(size_t limit)
+    {
+        return layout::hash_capacity(limit);
+    }
+    static inline uint64_t* hash_array(uint64_t *bitmap, size_t limit)
+    {
+        return (uint64_t*)((char*)bitmap + bitmap_capacity(limit) +
+                           fingerprint_capacity(limit));
+    }
+    inline uint64_t* hashes() { return hash_array(bitmap, limit); }
+    inline void hash_store(size_t i, uint64_t h)
+    {
+        if constexpr (Policy::store_hash) hashes()[i] = h;
+    }
+    inline bool hash_match(size_t i, uint64_t h)
+    {
+        if constexpr (Policy::store_hash) return hashes()[i] == h;
+        else return true;
+    }
+
+    /*
+     * link helpers: the prev and next links of slot i are in its entry,
+     * or with split_links in a slot array after the other metadata.
+     */
+
+    static inline size_t link_capacity(size_t limit)
+    {
+        return layout::link_capacity(limit);
+    }
+    static inline link_type* link_array(uint64_t *bitmap, size_t limit)
+    {
+        return (link_type*)((char*)hash_array(bitmap, limit) + hash_capacity(limit));
+    }
+    inline link_type* links() { return link_array(bitmap, limit); }
+    inline Offset& link_prev(size_t i)
+    {
+        if constexpr (Policy::split_links) return links()[i].prev;
+        else return data[i].prev;
+    }
+    inline Offset& link_next(size_t i)
+    {
+        if constexpr (Policy::split_links) return links()[i].next;
+        else return data[i].next;
+    }
+
+    /* moves the entry and the links of slot src to the empty slot dst */
+    inline void relocate_internal(size_t dst, size_t src)
+    {
+        relocate(&data[dst], &data[src]);
+        if constexpr (Policy::split_links) links()[dst] = links()[src];
+    }
+
+    /* returns the hash of the entry in slot i */
+    inline uint64_t slot_hash(size_t i)
+    {
+        if constexpr (Policy::store_hash) return hashes()[i];
+        else return key_hash(data[i].first);
+    }
+
+    /* bytes of the data array at the start of the table */
+    static inline size_t data_capacity(size_t limit)
+    {
+        return data_layout::data_capacity(limit);
+    }
+
+    /* bytes of slot metadata allocated after the data array */
+    static inline size_t metadata_capacity(size_t limit)
+    {
+        return layout::metadata_capacity(limit);
+    }
+
+    /* returns the first occupied slot at or after slot i, or limit */
+    inline size_t bitmap_next(size_t i)
+    {
+        while (i < limit) {
+            size_t n = bitmap_span(i);
+            uint64_t occ = bitmap_occupied(bitmap_word(bitmap, i)) & bitmap_mask(n);
+            if (occ) return i + bitmap_ctz(occ);
+            i += n;
+        }
+        return limit;
+    }
+
+    /* calls fn for each occupied slot, visiting one bitmap word at a time */
+    template <typename F>
+    static inline void bitmap_foreach(uint64_t *bitmap, size_t limit, F fn)
+    {
+        for (size_t i = 0; i < limit; i += 32) {
+            uint64_t occ = bitmap_occupied(bitmap[bitmap_idx(i)]);
+            for (occ &= bitmap_mask(limit - i); occ; occ &= occ - 1) {
+                fn(i + bitmap_ctz(occ));
+            }
+        }
+    }
+
+    /* moves the element at src to uninitialized dst and ends the
+     * lifetime of src, with memcpy for trivially relocatable types */
+    static inline void relocate(data_type *dst, data_type *src)
+    {
+        if constexpr (relocatable) {
+            memcpy((void*)dst, (void*)src, sizeof(data_type));
+        } else {
+            new (dst) data_type(std::move(*src));
+            src->~data_type();
+        }
+    }
+
+    /* the number of blocks holding size bytes */
+    static inline size_t block_count(size_t size)
+    {
+        return (size + sizeof(block_type) - 1) / sizeof(block_type);
+    }
+
+    /* whether the table is in the inline storage of the object */
+    inline bool inline_internal()
+    {
+        return inline_capacity && data == (data_type*)_inline.get();
+    }
+
+    /* tables of inline_capacity slots, which are the smallest tables,
+     * take the inline storage and larger tables take a block */
+    data_type* allocate_internal(size_t size)
+    {
+        if (size <= inline_size) return (data_type*)_inline.get();
+        return (data_type*)std::to_address(block_traits::allocate(_alloc, block_count(size)));
+    }
+
+    void deallocate_internal(data_type *p, size_t limit)
+    {
+        if (inline_capacity && p == (data_type*)_inline.get()) return;
+        size_t size = data_capacity(limit) + metadata_capacity(limit);
+        block_traits::deallocate(_alloc, std::pointer_traits<typename block_traits::pointer>
+            ::pointer_to(*(block_type*)p), block_count(size));
+    }
+
+    /* moves the entries of o into a table of our own, leaving o empty.
+     * used when moving from a table in the inline storage of o, or by
+     * move assignment when the allocators are unequal and do not
+     * propagate, so the block of o cannot be taken over */
+    void move_internal(linked_hash_set &o)
+    {
+        used = o.used;
+        tombs = o.tombs;
+        limit = o.limit;
+        max_load = o.max_load;
+        _hasher = o._hasher;
+        _compare = o._compare;
+
+        size_t data_size = data_capacity(limit);
+        size_t bitmap_size = metadata_capacity(limit);
+        size_t total_size = data_size + bitmap_size;
+
+        data = allocate_internal(total_size);
+        bitmap = (uint64_t*)((char*)data + data_size);
+
+        memcpy(bitmap, o.bitmap, bitmap_size);
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            relocate(&data[i], &o.data[i]);
+        });
+        memset(o.bitmap, 0, bitmap_size);
+        o.used = o.tombs = 0;
+        head = o.head;
+        tail = o.tail;
+        o.head = o.tail = empty_offset;
+    }
+
     /**
      * the implementation
      */
 
-    void resize_internal(data_type *old_data, uint64_t *old_bitmap,
-                         size_t old_limit, size_t new_limit)
+    /* rebuilds the table in list order and returns the new slot of the
+     * entry that was in slot track, so callers need not find it again */
+    size_t resize_internal(data_type *old_data, uint64_t *old_bitmap,
+                           size_t old_limit, size_t new_limit,
+                           size_t track = size_t(-1))
     {
-        size_t data_size = sizeof(data_type) * new_limit;
-        size_t bitmap_size = bitmap_capacity(new_limit);
+        size_t data_size = data_capacity(new_limit);
+        size_t bitmap_size = metadata_capacity(new_limit);
         size_t total_size = data_size + bitmap_size;
 
         assert(is_pow2(new_limit));
 
-        data = (data_type*)malloc(total_size);
+        data = allocate_internal(total_size);
         bitmap = (uint64_t*)((char*)data + data_size);
         limit = new_limit;
         memset(bitmap, 0, bitmap_size);
 
+        size_t tracked = new_limit;
         offset_type k = empty_offset;
-        for (size_t i = head; i != empty_offset; i = old_data[i].next) {
+        for (size_t i = head, n; i != empty_offset; i = n) {
             data_type *v = old_data + i;
-            for (size_t j = key_index(v->first); ; j = (j+1) & index_mask()) {
-                if ((bitmap_get(bitmap, j) & occupied) != occupied) {
+            if constexpr (Policy::split_links) n = link_array(old_bitmap, old_limit)[i].next;
+            else n = v->next;
+            uint64_t h = Policy::store_hash ? hash_array(old_bitmap, old_limit)[i] :
+                                              key_hash(v->first);
+            size_t j = free_internal(hash_index(h));
+            bitmap_set(bitmap, j, occupied);
+            fingerprint_set(j, h);
+            hash_store(j, h);
+            relocate(&data[j], v);
+            if (i == track) tracked = j;
+            link_next(j) = empty_offset;
+            if (k == empty_offset) {
+                head = (offset_type)j;
+                link_prev(j) = empty_offset;
+            } else {
+                link_prev(j) = (offset_type)k;
+                link_next(k) = (offset_type)j;
+            }
+            k = (offset_type)j;
+        }
+        tail = k;
+
+        tombs = 0;
+        deallocate_internal(old_data, old_limit);
+        return tracked;
+    }
+
+    /* exchanges the entries in slots i and j */
+    void swap_internal(size_t i, size_t j)
+    {
+        alignas(data_type) char t[sizeof(data_type)];
+        relocate((data_type*)t, &data[i]);
+        relocate(&data[i], &data[j]);
+        relocate(&data[j], (data_type*)t);
+        if constexpr (Policy::split_links) std::swap(links()[i], links()[j]);
+        auto r = [&](offset_type k) {
+            return k == (offset_type)i ? (offset_type)j : k == (offset_type)j ? (offset_type)i : k;
+        };
+        link_prev(i) = r(link_prev(i));
+        link_next(i) = r(link_next(i));
+        link_prev(j) = r(link_prev(j));
+        link_next(j) = r(link_next(j));
+        relink_internal((offset_type)i);
+        relink_internal((offset_type)j);
+    }
+
+    /*
+     * rehashes the table in place at the same capacity, dropping the
+     * tombstones. occupied slots are first marked recycled, which means
+     * not yet placed, and deleted slots become available. each recycled
+     * entry then moves to the first unplaced slot of its probe sequence,
+     * which is either available, or recycled in which case the entries
+     * are exchanged and the displaced entry is placed next. returns the
+     * new slot of the entry that was in slot track.
+     */
+    size_t purge_internal(size_t track = size_t(-1))
+    {
+        for (size_t i = 0; i < limit; i += 32) {
+            uint64_t occ = bitmap[bitmap_idx(i)] & bitmap_even;
+            bitmap[bitmap_idx(i)] = occ | (occ << 1);
+        }
+        for (size_t i = 0; i < limit; i++) {
+            while (bitmap_get(bitmap, i) == recycled) {
+                uint64_t h = slot_hash(i);
+                size_t j = unplaced_internal(hash_index(h));
+                if (j == i) {
+                    bitmap_clear(bitmap, i, deleted);
+                } else if (bitmap_get(bitmap, j) == available) {
+                    relocate_internal(j, i);
+                    relink_internal((offset_type)j);
                     bitmap_set(bitmap, j, occupied);
-                    if (i == head) head = (offset_type)j;
-                    if (i == tail) tail = (offset_type)j;
-                    data[j].first = /* copy */ v->first;
-                    data[j].next = empty_offset;
-                    if (k == empty_offset) {
-                        data[j].prev = empty_offset;
-                    } else {
-                        data[j].prev = (offset_type)k;
-                        data[k].next = (offset_type)j;
-                    }
-                    k = (offset_type)j;
-                    break;
+                    bitmap_clear(bitmap, i, recycled);
+                    if (track == i) track = j;
+                } else {
+                    swap_internal(i, j);
+                    if constexpr (Policy::store_hash) hashes()[i] = hashes()[j];
+                    bitmap_clear(bitmap, j, deleted);
+                    if (track == i) track = j;
+                    else if (track == j) track = i;
                 }
+                fingerprint_set(j, h);
+                hash_store(j, h);
             }
         }
-
         tombs = 0;
-        for (size_t i = 0; i < old_limit; i++) {
-            if ((bitmap_get(old_bitmap, i) & occupied) == occupied) {
-                old_data[i].~data_type();
+        return track;
+    }
+
+    /* prefetches the bitmap word, metadata and entry of slot i */
+    void prefetch_internal(size_t i)
+    {
+        hash_prefetch(bitmap + bitmap_idx(i));
+        if constexpr (Policy::fingerprint) hash_prefetch(fingerprints() + i);
+        if constexpr (Policy::store_hash) hash_prefetch(hashes() + i);
+        hash_prefetch(data + i);
+    }
+
+    /* returns the first free slot in the probe sequence from slot i */
+    size_t free_internal(size_t i)
+    {
+        for (;;) {
+            size_t n = bitmap_span(i);
+            uint64_t m = bitmap_mask(n);
+            uint64_t free = bitmap_free(bitmap_word(bitmap, i)) & m;
+            if (free) return i + bitmap_ctz(free);
+            i = (i + n) & index_mask();
+        }
+    }
+
+    /* returns the first available or recycled slot in the probe sequence
+     * from slot i, which is the first slot not yet placed while purging */
+    size_t unplaced_internal(size_t i)
+    {
+        for (;;) {
+            size_t n = bitmap_span(i);
+            uint64_t m = bitmap_mask(n);
+            uint64_t unplaced = bitmap_unplaced(bitmap_word(bitmap, i)) & m;
+            if (unplaced) return i + bitmap_ctz(unplaced);
+            i = (i + n) & index_mask();
+        }
+    }
+
+    /* returns the slot containing key or limit if key is not present */
+    size_t find_internal(const Key &key)
+    {
+        return find_internal(key, key_hash(key));
+    }
+
+    size_t find_internal(const Key &key, uint64_t h)
+    {
+        uint8_t tag = hash_fingerprint(h);
+        for (size_t i = hash_index(h); ; ) {
+            size_t n = bitmap_span(i);
+            uint64_t w = bitmap_word(bitmap, i), m = bitmap_mask(n);
+            uint64_t avail = bitmap_available(w) & m;
+            uint64_t occ = bitmap_occupied(w) & m & bitmap_below(avail);
+            if constexpr (Policy::fingerprint) occ &= fingerprint_mask(i, tag);
+            for (; occ; occ &= occ - 1) {
+                size_t j = i + bitmap_ctz(occ);
+                if (hash_match(j, h) && _compare(data[j].first, key)) return j;
             }
+            if (avail) return limit;
+            i = (i + n) & index_mask();
         }
-        free(old_data);
+    }
+
+    /* returns the slot containing key with hash h, or the first free slot
+     * in its probe sequence with found set to false if key is not present */
+    size_t probe_internal(const Key &key, uint64_t h, bool &found)
+    {
+        size_t slot = limit;
+        uint8_t tag = hash_fingerprint(h);
+        for (size_t i = hash_index(h); ; ) {
+            size_t n = bitmap_span(i);
+            uint64_t w = bitmap_word(bitmap, i), m = bitmap_mask(n);
+            uint64_t avail = bitmap_available(w) & m;
+            uint64_t occ = bitmap_occupied(w) & m & bitmap_below(avail);
+            if constexpr (Policy::fingerprint) occ &= fingerprint_mask(i, tag);
+            uint64_t free = bitmap_free(w) & m;
+            if (slot == limit && free) slot = i + bitmap_ctz(free);
+            for (; occ; occ &= occ - 1) {
+                size_t j = i + bitmap_ctz(occ);
+                if (hash_match(j, h) && _compare(data[j].first, key)) {
+                    found = true;
+                    return j;
+                }
+            }
+            if (avail) {
+                found = false;
+                return slot;
+            }
+            i = (i + n) & index_mask();
+        }
+    }
+
+    /* marks free slot i occupied for hash h and returns it */
+    size_t claim_internal(uint64_t h, size_t i)
+    {
+        if (bitmap_get(bitmap, i) == deleted) tombs--;
+        used++;
+        bitmap_set(bitmap, i, occupied);
+        fingerprint_set(i, h);
+        hash_store(i, h);
+        return i;
     }
 
     /* inserts indice link before specified position */
@@ -293,23 +806,32 @@ struct linked_hash_set
     {
         if (head == tail && head == empty_offset) {
             head = tail = i;
-            data[i].next = data[i].prev = empty_offset;
+            link_next(i) = link_prev(i) = empty_offset;
         } else if (pos == empty_offset) {
-            data[i].next = empty_offset;
-            data[i].prev = tail;
-            data[tail].next = i;
+            link_next(i) = empty_offset;
+            link_prev(i) = tail;
+            link_next(tail) = i;
             tail = i;
         } else {
-            data[i].next = pos;
-            data[i].prev = data[pos].prev;
-            if (data[pos].prev != empty_offset) {
-                data[data[pos].prev].next = i;
+            link_next(i) = pos;
+            link_prev(i) = link_prev(pos);
+            if (link_prev(pos) != empty_offset) {
+                link_next(link_prev(pos)) = i;
             }
-            data[pos].prev = i;
+            link_prev(pos) = i;
             if (head == pos) head = i;
         }
     }
 
+    /* points the neighbours of the entry in slot i back at slot i */
+    void relink_internal(offset_type i)
+    {
+        if (link_prev(i) == empty_offset) head = i;
+        else link_next(link_prev(i)) = i;
+        if (link_next(i) == empty_offset) tail = i;
+        else link_prev(link_next(i)) = i;
+    }
+
     /* remove indice link at the specified index */
     void erase_link_internal(offset_type i)
     {
@@ -317,89 +839,251 @@ struct linked_hash_set
         if (head == tail && i == head) {
             head = tail = empty_offset;
         } else {
-            if (head == i) head = data[i].next;
-            if (tail == i) tail = data[i].prev;
-            if (data[i].prev != empty_offset) {
-                data[data[i].prev].next = data[i].next;
+            if (head == i) head = link_next(i);
+            if (tail == i) tail = link_prev(i);
+            if (link_prev(i) != empty_offset) {
+                link_next(link_prev(i)) = link_next(i);
             }
-            if (data[i].next != empty_offset) {
-                data[data[i].next].prev = data[i].prev;
+            if (link_next(i) != empty_offset) {
+                link_prev(link_next(i)) = link_prev(i);
             }
         }
     }
 
-    void clear()
+    /* returns the slot for key and false if present, otherwise claims a
+     * slot, constructs the entry from key, links it before pos, and
+     * returns true */
+    template <typename K>
+    std::pair<size_t,bool> emplace_internal(offset_type pos, K &&key)
     {
-        for (size_t i = 0; i < limit; i++) {
-            if ((bitmap_get(bitmap, i) & occupied) == occupied) {
-                data[i].~data_type();
-            }
+        uint64_t h = key_hash(key);
+        return emplace_hash_internal(pos, h, std::forward<K>(key));
+    }
+
+    /* emplace_internal for a key whose hash h is already known */
+    template <typename K>
+    std::pair<size_t,bool> emplace_hash_internal(offset_type pos, uint64_t h, K &&key)
+    {
+        bool found;
+        size_t i = probe_internal(key, h, found);
+        if (found) return { i, false };
+        i = claim_internal(h, i);
+        new (&data[i].first) Key(std::forward<K>(key));
+        insert_link_internal(pos, (offset_type)i);
+        if (load() > max_load) {
+            i = purge_due() ? purge_internal(i) :
+                resize_internal(data, bitmap, limit, limit << 1, i);
         }
-        size_t bitmap_size = bitmap_capacity(limit);
+        return { i, true };
+    }
+
+    /*
+     * backward-shift deletion: the entry in slot i has been destroyed.
+     * each following entry of the cluster that may live in the hole,
+     * because its home slot is not between the hole and itself, moves
+     * back into it and leaves a hole of its own. the last hole becomes
+     * available, so no tombstone is left behind.
+     */
+    void shift_internal(size_t i)
+    {
+        for (size_t j = (i + 1) & index_mask(); ; j = (j + 1) & index_mask()) {
+            if (!(bitmap_get(bitmap, j) & occupied)) break;
+            size_t k = hash_index(slot_hash(j));
+            if (((j - k) & index_mask()) < ((j - i) & index_mask())) continue;
+            relocate_internal(i, j);
+            relink_internal((offset_type)i);
+            if constexpr (Policy::fingerprint) fingerprints()[i] = fingerprints()[j];
+            if constexpr (Policy::store_hash) hashes()[i] = hashes()[j];
+            i = j;
+        }
+        bitmap_clear(bitmap, i, recycled);
+    }
+
+    /* sets the load factor at which the table doubles, clamped to
+     * [0.0625, 0.9375] so that probes always find an available slot.
+     * f is clamped before conversion, and NaN takes the minimum */
+    void max_load_factor(float f)
+    {
+        float lo = (float)load_min / load_multiplier, hi = (float)load_max / load_multiplier;
+        f = !(f >= lo) ? lo : f > hi ? hi : f;
+        max_load = (size_t)(f * load_multiplier);
+        reserve(used);
+    }
+
+    /* sets the capacity to hold at least n entries without growing */
+    void reserve(size_t n)
+    {
+        size_t new_limit = capacity_for(n, max_load);
+        if (new_limit > limit) {
+            resize_internal(data, bitmap, limit, new_limit);
+        }
+    }
+
+    /* rebuilds the table with at least count slots, or more if needed
+     * for the current size, which may shrink it and drops tombstones.
+     * the table keeps min_size slots so the bitmap stays word aligned */
+    void rehash(size_t count)
+    {
+        size_t new_limit = std::bit_ceil(count);
+        size_t min_limit = capacity_for(used, max_load);
+        if (new_limit < min_limit) new_limit = min_limit;
+        if (new_limit < inline_capacity) new_limit = inline_capacity;
+        if (new_limit != limit) {
+            resize_internal(data, bitmap, limit, new_limit);
+        } else if (tombs) {
+            purge_internal();
+        }
+    }
+
+    /* drops tombstones in place without changing the capacity */
+    void purge()
+    {
+        if (tombs) purge_internal();
+    }
+
+    /* shrinks the capacity to the smallest that holds the current size */
+    void shrink_to_fit() { rehash(0); }
+
+    void clear()
+    {
+        bitmap_foreach(bitmap, limit, [&](size_t i) {
+            data[i].~data_type();
+        });
+        size_t bitmap_size = metadata_capacity(limit);
         memset(bitmap, 0, bitmap_size);
         head = tail = empty_offset;
         used = tombs = 0;
     }
 
     iterator insert(const value_type& val) { return insert(end(), val); }
+    iterator insert(value_type&& val) { return insert(end(), std::move(val)); }
 
-    iterator insert(iterator h, const value_type& v)
-    {
-        for (size_t i = key_index(v); ; i = (i+1) & index_mask()) {
-            bitmap_state state = bitmap_get(bitmap, i);
-            if ((state & recycled) == available) {
-                bitmap_set(bitmap, i, occupied);
-                data[i].first = /* copy */ v;
-                insert_link_internal((offset_type)h.i, (offset_type)i);
-                used++;
-                if ((state & deleted) == deleted) tombs--;
-                if (load() > load_factor) {
-                    resize_internal(data, bitmap, limit, limit << 1);
-                    for (i = key_index(v); ; i = (i+1) & index_mask()) {
-                        bitmap_state state = bitmap_get(bitmap, i);
-                             if (state == available) abort();
-                        else if (state == deleted); /* skip */
-                        else if (_compare(data[i].first, v)) {
-                            return iterator{this, i};
-                        }
-                    }
-                } else {
-                    return iterator{this, i};
-                }
-            } else if (_compare(data[i].first, v)) {
-                return iterator{this, i};
+    iterator insert(iterator pos, const value_type& v)
+    {
+        return iterator{this, emplace_internal((offset_type)pos.i, v).first};
+    }
+
+    iterator insert(iterator pos, value_type&& v)
+    {
+        return iterator{this, emplace_internal((offset_type)pos.i, std::move(v)).first};
+    }
+
+    /* appends each key of the range in order. a forward range sizes
+     * the table once up front, so it never grows */
+    template <std::input_iterator It>
+    void insert(It first, It last)
+    {
+        if constexpr (std::forward_iterator<It>) {
+            reserve(used + (size_t)std::distance(first, last));
+            insert_batch_internal(first, last);
+        } else {
+            for (; first != last; ++first) insert(end(), *first);
+        }
+    }
+
+    /* constructs a key from args and appends it if absent */
+    template <typename... Args>
+    std::pair<iterator,bool> emplace(Args&&... args)
+    {
+        return emplace_hint(end(), std::forward<Args>(args)...);
+    }
+
+    /* constructs a key from args and links it before pos if absent */
+    template <typename... Args>
+    std::pair<iterator,bool> emplace_hint(iterator pos, Args&&... args)
+    {
+        Key key(std::forward<Args>(args)...);
+        auto r = emplace_internal((offset_type)pos.i, std::move(key));
+        return { iterator{this, r.first}, r.second };
+    }
+
+    /*
+     * looks up n keys in groups of prefetch_batch. each group is hashed
+     * and the home slots prefetched before any is probed, so the cache
+     * misses of the group overlap instead of being taken one at a time.
+     */
+    template <typename F>
+    void find_batch_internal(const Key *keys, size_t n, F fn)
+    {
+        uint64_t h[prefetch_batch];
+        for (size_t b = 0; b < n; b += prefetch_batch) {
+            size_t m = n - b < prefetch_batch ? n - b : prefetch_batch;
+            for (size_t k = 0; k < m; k++) {
+                h[k] = key_hash(keys[b + k]);
+                prefetch_internal(hash_index(h[k]));
+            }
+            for (size_t k = 0; k < m; k++) {
+                fn(b + k, find_internal(keys[b + k], h[k]));
             }
         }
     }
 
-    iterator find(const Key &key)
+    /* appends a forward range in groups of prefetch_batch keys. the
+     * home slots of a group are hashed and prefetched before any key
+     * of the group is inserted, so the misses on a large table overlap */
+    template <std::forward_iterator It>
+    void insert_batch_internal(It first, It last)
     {
-        for (size_t i = key_index(key); ; i = (i+1) & index_mask()) {
-            bitmap_state state = bitmap_get(bitmap, i);
-                 if (state == available)           /* notfound */ break;
-            else if (state == deleted);            /* skip */
-            else if (_compare(data[i].first, key)) return iterator{this, i};
+        uint64_t h[prefetch_batch];
+        while (first != last) {
+            It group = first;
+            size_t m = 0;
+            for (; m < prefetch_batch && first != last; ++first, m++) {
+                h[m] = key_hash(*first);
+                prefetch_internal(hash_index(h[m]));
+            }
+            for (size_t k = 0; k < m; ++group, k++) {
+                emplace_hash_internal(empty_offset, h[k], *group);
+            }
         }
-        return end();
+    }
+
+    /* sets out[k] to the iterator for keys[k] or end() for k < n */
+    void find_many(const Key *keys, size_t n, iterator *out)
+    {
+        find_batch_internal(keys, n, [&](size_t k, size_t i) {
+            out[k] = i == limit ? end() : iterator{this, i};
+        });
+    }
+
+    /* sets out[k] to whether keys[k] is present for k < n */
+    void contains_many(const Key *keys, size_t n, bool *out)
+    {
+        find_batch_internal(keys, n, [&](size_t k, size_t i) {
+            out[k] = i != limit;
+        });
+    }
+
+    iterator find(const Key &key)
+    {
+        size_t i = find_internal(key);
+        return i == limit ? end() : iterator{this, i};
     }
 
     void erase(Key key)
     {
-        for (size_t i = key_index(key); ; i = (i+1) & index_mask()) {
-            bitmap_state state = bitmap_get(bitmap, i);
-                 if (state == available)           /* notfound */ break;
-            else if (state == deleted);            /* skip */
-            else if (_compare(data[i].first, key)) {
-                bitmap_set(bitmap, i, deleted);
-                data[i].~data_type();
-                bitmap_clear(bitmap, i, occupied);
-                erase_link_internal((offset_type)i);
-                used--;
-                tombs++;
-                return;
-            }
+        size_t i = find_internal(key);
+        if (i == limit) return;
+        erase_link_internal((offset_type)i);
+        if constexpr (Policy::backward_shift) {
+            data[i].~data_type();
+            shift_internal(i);
+            used--;
+        } else {
+            bitmap_set(bitmap, i, deleted);
+            data[i].~data_type();
+            bitmap_clear(bitmap, i, occupied);
+            used--;
+            tombs++;
         }
     }
 };
 
+template <class Key, class Offset, class Hash, class Pred, class Policy, class Allocator>
+struct is_trivially_relocatable<linked_hash_set<Key,Offset,Hash,Pred,Policy,Allocator>>
+    : std::bool_constant<Policy::inline_capacity == 0 &&
+                         is_trivially_relocatable<Allocator>::value &&
+                         is_trivially_relocatable<Hash>::value &&
+                         is_trivially_relocatable<Pred>::value> {};
+
 };
\ No newline at end of file
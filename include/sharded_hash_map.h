@@ -0,0 +1,274 @@
+/*
+ * Sharded open addressing hash table with a lock per shard.
+ *
+ * Copyright (c) 2020 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <bit>
+#include <mutex>
+#include <utility>
+#include <functional>
+#include <memory>
+#include <new>
+
+#include "hash_map.h"
+
+namespace ethical {
+
+/*
+ * sharded_hash_map is a hash_map for write-heavy use from many threads,
+ * such as counters and session tables. keys are routed by the high bits
+ * of their hash to one of Shards independent hash_map shards, each with
+ * its own lock padded to a cache line, so writers to different shards
+ * neither wait for each other nor share a cache line. each shard grows
+ * on its own, so a resize holds up only the writers of one shard.
+ *
+ * the hash is computed once per operation: the shard is chosen by a
+ * fibonacci multiply of the mixed hash, whose top bits depend on all of
+ * its bits, and the shard probes with the low bits of the same hash.
+ *
+ * references to entries cannot outlive the shard lock, so lookups copy
+ * the value out, and visit and update call a function with the value
+ * under the lock for atomic read-modify-write:
+ *
+ *     ethical::sharded_hash_map<std::string,size_t> counts;
+ *     counts.update(word, [](size_t &n) { n++; });
+ */
+
+template <class Key, class Value,
+          size_t Shards = (2<<5), /* 64 */
+          class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>,
+          class Policy = hash_policy,
+          class Allocator = std::allocator<std::pair<const Key, Value>>>
+struct sharded_hash_map
+{
+    static const size_t cache_line_size = (2<<5); /* 64 */
+    static const size_t shard_count = Shards;
+    static const size_t shard_bits = std::countr_zero(Shards);
+
+    static_assert(std::has_single_bit(Shards),
+                  "Shards must be a power of two");
+
+    typedef hash_map<Key,Value,Hash,Pred,Policy,Allocator> map_type;
+
+    struct alignas(cache_line_size) shard_type {
+        std::mutex lock;
+        map_type map;
+
+        shard_type(size_t size, const Hash &hash, const Pred &pred,
+                   const Allocator &alloc) : map(size, hash, pred, alloc) {}
+    };
+
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<Key, Value> value_type;
+    typedef Hash hasher;
+    typedef Pred key_equal;
+    typedef Policy policy_type;
+    typedef Allocator allocator_type;
+    typedef typename map_type::mixer_type mixer_type;
+
+    shard_type *shards;
+    [[no_unique_address]] Hash _hasher;
+
+    /*
+     * constructors and destructor
+     */
+
+    /* initial_size is a slot count for the whole map, divided among
+     * the shards, which each start with at least default_size slots.
+     * the shards are constructed in place in cache line aligned storage
+     * so that each map allocates its table once */
+    inline sharded_hash_map() : sharded_hash_map(map_type::default_size * Shards) {}
+    explicit inline sharded_hash_map(const Allocator &alloc) :
+        sharded_hash_map(map_type::default_size * Shards, Hash(), Pred(), alloc) {}
+    inline sharded_hash_map(size_t initial_size, const Hash &hash = Hash(),
+                            const Pred &pred = Pred(),
+                            const Allocator &alloc = Allocator()) :
+        shards((shard_type*)::operator new(sizeof(shard_type) * Shards,
+                                           std::align_val_t(alignof(shard_type)))),
+        _hasher(hash)
+    {
+        size_t shard_size = initial_size / Shards;
+        if (shard_size < map_type::default_size) shard_size = map_type::default_size;
+        size_t s = 0;
+        try {
+            for (; s < Shards; s++) {
+                new (&shards[s]) shard_type(shard_size, hash, pred, alloc);
+            }
+        } catch (...) {
+            while (s > 0) shards[--s].~shard_type();
+            ::operator delete(shards, std::align_val_t(alignof(shard_type)));
+            throw;
+        }
+    }
+
+    inline ~sharded_hash_map()
+    {
+        for (size_t s = 0; s < Shards; s++) shards[s].~shard_type();
+        ::operator delete(shards, std::align_val_t(alignof(shard_type)));
+    }
+
+    sharded_hash_map(const sharded_hash_map &) = delete;
+    sharded_hash_map& operator=(const sharded_hash_map &) = delete;
+
+    /*
+     * member functions
+     */
+
+    inline uint64_t key_hash(const Key &key) { return mixer_type::mix(_hasher(key)); }
+    inline hasher hash_function() const { return _hasher; }
+    inline key_equal key_eq() const { return shards[0].map.key_eq(); }
+    inline allocator_type get_allocator() const { return shards[0].map.get_allocator(); }
+
+    /* the shard for hash h, selected by the top bits of a fibonacci
+     * multiply so that the low bits used by the shard stay independent */
+    static inline size_t shard_index(uint64_t h)
+    {
+        if constexpr (shard_bits == 0) return 0;
+        else return (h * 0x9e3779b97f4a7c15ull) >> (64 - shard_bits);
+    }
+    inline shard_type& shard_for(uint64_t h) { return shards[shard_index(h)]; }
+
+    /* calls fn with the map of each shard in turn under its lock */
+    template <typename F>
+    void foreach_shard(F fn)
+    {
+        for (size_t s = 0; s < Shards; s++) {
+            std::lock_guard<std::mutex> guard(shards[s].lock);
+            fn(shards[s].map);
+        }
+    }
+
+    /* the number of entries, summed shard by shard, so it is exact
+     * only when there are no concurrent writers */
+    size_t size()
+    {
+        size_t n = 0;
+        foreach_shard([&](map_type &m) { n += m.size(); });
+        return n;
+    }
+
+    size_t capacity()
+    {
+        size_t n = 0;
+        foreach_shard([&](map_type &m) { n += m.capacity(); });
+        return n;
+    }
+
+    /* sets the capacity of each shard to hold its share of n entries */
+    void reserve(size_t n)
+    {
+        foreach_shard([&](map_type &m) { m.reserve((n + Shards - 1) / Shards); });
+    }
+
+    void clear()
+    {
+        foreach_shard([&](map_type &m) { m.clear(); });
+    }
+
+    /* inserts or assigns the value for key, returning true if inserted */
+    bool insert(const Key &key, const Value &val)
+    {
+        return insert_or_assign(key, val);
+    }
+
+    template <typename M>
+    bool insert_or_assign(const Key &key, M&& obj)
+    {
+        uint64_t h = key_hash(key);
+        shard_type &s = shard_for(h);
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto r = s.map.emplace_hash_internal(h, key, std::forward<M>(obj));
+        if (!r.second) s.map.slot_value(r.first) = std::forward<M>(obj);
+        return r.second;
+    }
+
+    /* constructs the value in place from args if the key is absent,
+     * returning true if inserted */
+    template <typename... Args>
+    bool try_emplace(const Key &key, Args&&... args)
+    {
+        uint64_t h = key_hash(key);
+        shard_type &s = shard_for(h);
+        std::lock_guard<std::mutex> guard(s.lock);
+        return s.map.emplace_hash_internal(h, key, std::forward<Args>(args)...).second;
+    }
+
+    /* erases the entry for key, returning true if it was present */
+    bool erase(const Key &key)
+    {
+        uint64_t h = key_hash(key);
+        shard_type &s = shard_for(h);
+        std::lock_guard<std::mutex> guard(s.lock);
+        size_t i = s.map.find_internal(key, h);
+        if (i == s.map.limit) return false;
+        s.map.erase_internal(i);
+        return true;
+    }
+
+    /* copies the value for key to val, returning true if present */
+    bool find(const Key &key, Value &val)
+    {
+        return visit(key, [&](Value &v) { val = v; });
+    }
+
+    bool contains(const Key &key)
+    {
+        return visit(key, [](Value &) {});
+    }
+
+    /* calls fn with the value for key under the shard lock, returning
+     * true if key is present */
+    template <typename F>
+    bool visit(const Key &key, F fn)
+    {
+        uint64_t h = key_hash(key);
+        shard_type &s = shard_for(h);
+        std::lock_guard<std::mutex> guard(s.lock);
+        size_t i = s.map.find_internal(key, h);
+        if (i == s.map.limit) return false;
+        fn(s.map.slot_value(i));
+        return true;
+    }
+
+    /* calls fn with the value for key under the shard lock, inserting a
+     * value initialized value first if key is absent, as operator[] */
+    template <typename F>
+    void update(const Key &key, F fn)
+    {
+        uint64_t h = key_hash(key);
+        shard_type &s = shard_for(h);
+        std::lock_guard<std::mutex> guard(s.lock);
+        fn(s.map.slot_value(s.map.emplace_hash_internal(h, key).first));
+    }
+
+    /* calls fn with the key and value of each entry, one shard at a time */
+    template <typename F>
+    void for_each(F fn)
+    {
+        foreach_shard([&](map_type &m) {
+            for (auto &&ent : m) fn((const Key&)ent.first, ent.second);
+        });
+    }
+};
+
+};
\ No newline at end of file
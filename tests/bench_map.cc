@@ -6,10 +6,21 @@
 #include <map>
 #include <unordered_map>
 #include <vector>
+#include <algorithm>
 #include <functional>
+#include <mutex>
+#include <thread>
+#include <shared_mutex>
 
 #include "hash_map.h"
 #include "linked_hash_map.h"
+#include "hash_allocator.h"
+#include "concurrent_hash_map.h"
+#include "sharded_hash_map.h"
+#include "hash_set.h"
+#include "concurrent_hash_set.h"
+#include "incremental_hash_map.h"
+#include "test_policies.h"
 
 using namespace std::chrono;
 
@@ -149,6 +160,457 @@ void bench_map(const char* name, size_t count)
     print_timings(name, t1, t2, t3, t4, t5, t6, count);
 }
 
+static const float load_factors[] = { 0.375f, 0.5f, 0.625f, 0.75f, 0.8125f, 0.875f, 0.9375f, 0 };
+
+struct xxh3_policy : ethical::hash_policy
+{
+    typedef ethical::hash_mix_xxh3 mixer;
+};
+
+struct parallel_policy : ethical::hash_policy
+{
+    static const size_t parallel_resize = (2<<15); /* 64Ki */
+};
+
+/* a value of two cache lines, as held by metadata caches */
+struct large_value
+{
+    uint64_t id;
+    char pad[120];
+
+    large_value() = default;
+    large_value(uint64_t id) : id(id) {}
+};
+
+/* fills a table of the capacity for count entries to each load factor */
+template <typename Map>
+void bench_load(const char *name, size_t count)
+{
+    typedef std::pair<typename Map::key_type,typename Map::mapped_type> pair_type;
+
+    size_t limit = 1;
+    while (limit < count) limit <<= 1;
+    auto data = get_random<typename Map::key_type,typename Map::mapped_type>(limit * 2);
+
+    for (const float *f = load_factors; *f != 0; f++) {
+        size_t n = (size_t)(limit * *f) - 1;
+        Map ht;
+        ht.max_load_factor(*f);
+        auto t1 = system_clock::now();
+        for (size_t i = 0; i < n; i++) {
+            ht.insert(ht.end(), pair_type(data[i].first, data[i].second));
+        }
+        auto t2 = system_clock::now();
+        for (size_t i = 0; i < n; i++) {
+            assert(ht.find(data[i].first) != ht.end());
+        }
+        auto t3 = system_clock::now();
+        for (size_t i = limit; i < limit + n; i++) {
+            assert(ht.find(data[i].first) == ht.end());
+        }
+        auto t4 = system_clock::now();
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "_%s_", name);
+        printf("|%-40s|%8.4f|%12zu|%8.1f|%8.1f|%8.1f|%10.1f|\n", buf, *f, n,
+            duration_cast<nanoseconds>(t2-t1).count()/(float)n,
+            duration_cast<nanoseconds>(t3-t2).count()/(float)n,
+            duration_cast<nanoseconds>(t4-t3).count()/(float)n,
+            (Map::data_capacity(ht.capacity()) +
+             Map::metadata_capacity(ht.capacity())) / (float)n);
+    }
+    printf("|%-40s|%8s|%12s|%8s|%8s|%8s|%10s|\n", "-", "-", "-", "-", "-", "-", "-");
+}
+
+static const size_t batches[] = { 64, 256, 1024, 0 };
+
+/* compares find one key at a time with find_many in batches */
+template <typename Map>
+void bench_batch(const char *name, size_t count)
+{
+    typedef std::pair<typename Map::key_type,typename Map::mapped_type> pair_type;
+    typedef typename Map::key_type key_type;
+
+    Map ht;
+    auto data = get_random<key_type,typename Map::mapped_type>(count);
+    for (auto &ent : data) {
+        ht.insert(ht.end(), pair_type(ent.first, ent.second));
+    }
+    std::vector<key_type> keys;
+    for (auto &ent : data) keys.push_back(ent.first);
+    std::shuffle(keys.begin(), keys.end(), std::default_random_engine());
+    std::vector<typename Map::iterator> out(count);
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "_%s::find_", name);
+    auto t1 = system_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        out[i] = ht.find(keys[i]);
+    }
+    auto t2 = system_clock::now();
+    printf("|%-40s|%8zu|%12zu|%8.1f|\n", buf, (size_t)1, count,
+        duration_cast<nanoseconds>(t2-t1).count()/(float)count);
+
+    snprintf(buf, sizeof(buf), "_%s::find_many_", name);
+    for (const size_t *b = batches; *b != 0; b++) {
+        auto t1 = system_clock::now();
+        for (size_t i = 0; i < count; i += *b) {
+            ht.find_many(&keys[i], std::min(*b, count - i), &out[i]);
+        }
+        auto t2 = system_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            assert(out[i]->first == keys[i]);
+        }
+        printf("|%-40s|%8zu|%12zu|%8.1f|\n", buf, *b, count,
+            duration_cast<nanoseconds>(t2-t1).count()/(float)count);
+    }
+    printf("|%-40s|%8s|%12s|%8s|\n", "-", "-", "-", "-");
+}
+
+void heading_batch()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        "container", "batch", "count", "time_ns");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:");
+}
+
+/* compares building a table by inserting one entry at a time with
+ * building it from a range, which sizes it once and prefetches */
+template <typename Map>
+void bench_build(const char *name, size_t count)
+{
+    auto pairs = get_random<typename Map::key_type,typename Map::mapped_type>(count);
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "_%s_", name);
+    auto t1 = system_clock::now();
+    Map ht;
+    for (auto &ent : pairs) ht.insert(ht.end(), ent);
+    auto t2 = system_clock::now();
+    Map hr(pairs.begin(), pairs.end());
+    auto t3 = system_clock::now();
+    assert(ht.size() == hr.size());
+    printf("|%-40s|%8s|%12zu|%8.1f|\n", buf, "insert", count,
+        duration_cast<nanoseconds>(t2-t1).count()/(float)count);
+    printf("|%-40s|%8s|%12zu|%8.1f|\n", buf, "range", count,
+        duration_cast<nanoseconds>(t3-t2).count()/(float)count);
+    printf("|%-40s|%8s|%12s|%8s|\n", "-", "-", "-", "-");
+}
+
+void heading_build()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        "container", "build", "count", "time_ns");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:");
+}
+
+/* creates, fills and destroys count / 8 tables of 8 entries, with the
+ * tables allocated by alloc */
+template <typename Map>
+void bench_small(const char *name, const char *alloc_name, size_t count,
+                 typename Map::allocator_type alloc)
+{
+    std::vector<Map> maps;
+    auto t1 = system_clock::now();
+    for (size_t r = 0; r < 4; r++) {
+        for (size_t i = 0; i < count / 8; i++) {
+            maps.emplace_back(alloc);
+            for (size_t j = 0; j < 8; j++) maps.back()[i + j] = j;
+        }
+        maps.clear();
+    }
+    auto t2 = system_clock::now();
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "_%s_", name);
+    printf("|%-40s|%8s|%12zu|%8.1f|\n", buf, alloc_name, count / 8,
+        duration_cast<nanoseconds>(t2-t1).count()/(float)(count / 2));
+}
+
+void heading_small()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        "container", "alloc", "tables", "table_ns");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:");
+}
+
+/* hash_map behind a reader-writer lock, which readers contend on */
+template <typename Key, typename Value>
+struct shared_mutex_map
+{
+    ethical::hash_map<Key,Value> m;
+    std::shared_mutex lock;
+
+    void insert(const Key &key, const Value &value)
+    {
+        std::unique_lock<std::shared_mutex> guard(lock);
+        m.insert(key, value);
+    }
+
+    bool find(const Key &key, Value &value)
+    {
+        std::shared_lock<std::shared_mutex> guard(lock);
+        auto i = m.find(key);
+        if (i == m.end()) return false;
+        value = i->second;
+        return true;
+    }
+};
+
+/* looks up count random keys on each of 1 to hardware_concurrency
+ * threads and reports the lookups per microsecond of all threads */
+template <typename Map>
+void bench_readers(const char *name, size_t count)
+{
+    Map ht;
+    auto data = get_random<size_t,size_t>(count);
+    for (auto &ent : data) ht.insert(ent.first, ent.second);
+    size_t cores = std::thread::hardware_concurrency();
+
+    for (size_t n = 1; n <= (cores ? cores : 1); n <<= 1) {
+        std::vector<std::thread> threads;
+        auto t1 = system_clock::now();
+        for (size_t t = 0; t < n; t++) {
+            threads.emplace_back([&, t]() {
+                size_t v;
+                for (size_t i = 0; i < count; i++) {
+                    auto &ent = data[(i * 7919 + t * 104729) % count];
+                    bool found = ht.find(ent.first, v);
+                    assert(found && v == ent.second);
+                }
+            });
+        }
+        for (auto &t : threads) t.join();
+        auto t2 = system_clock::now();
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "_%s_", name);
+        printf("|%-40s|%8zu|%12zu|%8.1f|\n", buf, n, count,
+            (float)(n * count) / duration_cast<microseconds>(t2-t1).count());
+    }
+    printf("|%-40s|%8s|%12s|%8s|\n", "-", "-", "-", "-");
+}
+
+void heading_readers()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        "container", "threads", "count", "read_us");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:");
+}
+
+/* hash_map behind one lock, which caps writers at one core */
+template <typename Key, typename Value>
+struct mutex_map
+{
+    ethical::hash_map<Key,Value> m;
+    std::mutex lock;
+
+    template <typename F>
+    void update(const Key &key, F fn)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        fn(m[key]);
+    }
+};
+
+/* increments counters for count random keys of a set of count / 16 on
+ * each of 1 to hardware_concurrency threads and reports the updates
+ * per microsecond of all threads */
+template <typename Map>
+void bench_writers(const char *name, size_t count)
+{
+    auto data = get_random<size_t,size_t>(count / 16);
+    size_t cores = std::thread::hardware_concurrency();
+
+    for (size_t n = 1; n <= (cores ? cores : 1); n <<= 1) {
+        Map ht;
+        std::vector<std::thread> threads;
+        auto t1 = system_clock::now();
+        for (size_t t = 0; t < n; t++) {
+            threads.emplace_back([&, t]() {
+                for (size_t i = 0; i < count; i++) {
+                    auto &ent = data[(i * 7919 + t * 104729) % data.size()];
+                    ht.update(ent.first, [](size_t &v) { v++; });
+                }
+            });
+        }
+        for (auto &t : threads) t.join();
+        auto t2 = system_clock::now();
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "_%s_", name);
+        printf("|%-40s|%8zu|%12zu|%8.1f|\n", buf, n, count,
+            (float)(n * count) / duration_cast<microseconds>(t2-t1).count());
+    }
+    printf("|%-40s|%8s|%12s|%8s|\n", "-", "-", "-", "-");
+}
+
+void heading_writers()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        "container", "threads", "count", "write_us");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:");
+}
+
+/* times each of count inserts into an empty table and reports the
+ * median, the 99.99th percentile and the longest insert, which for a
+ * hash_map is the last doubling of the table */
+template <typename Map>
+void bench_latency(const char *name, size_t count)
+{
+    auto data = get_random<size_t,size_t>(count);
+    std::vector<size_t> times(count);
+
+    Map ht;
+    for (size_t i = 0; i < count; i++) {
+        auto t1 = system_clock::now();
+        ht.insert(data[i].first, data[i].second);
+        auto t2 = system_clock::now();
+        times[i] = duration_cast<nanoseconds>(t2-t1).count();
+    }
+    assert(ht.size() == count);
+    std::sort(times.begin(), times.end());
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "_%s_", name);
+    printf("|%-40s|%8s|%12zu|%8zu|\n", buf, "p50", count, times[count / 2]);
+    printf("|%-40s|%8s|%12zu|%8zu|\n", buf, "p99.99", count,
+        times[count - 1 - count / 10000]);
+    printf("|%-40s|%8s|%12zu|%8zu|\n", buf, "max", count, times[count - 1]);
+    printf("|%-40s|%8s|%12s|%8s|\n", "-", "-", "-", "-");
+}
+
+void heading_latency()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        "container", "insert", "count", "time_ns");
+    printf("|%-40s|%8s|%12s|%8s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:");
+}
+
+/* hash_set behind one lock, the usual way to share a set */
+template <typename Key>
+struct mutex_set
+{
+    ethical::hash_set<Key> s;
+    std::mutex lock;
+
+    bool insert(const Key &key)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t n = s.size();
+        s.insert(key);
+        return s.size() != n;
+    }
+};
+
+/* inserts count random keys, each drawn by two threads, spread over
+ * 1 to hardware_concurrency threads and reports the inserts per
+ * microsecond of all threads */
+template <typename Set>
+void bench_dedup(const char *name, size_t count)
+{
+    auto data = get_random<uint64_t,uint64_t>(count / 2);
+    size_t cores = std::thread::hardware_concurrency();
+
+    for (size_t n = 1; n <= (cores ? cores : 1); n <<= 1) {
+        Set hs;
+        std::atomic<size_t> inserted{0};
+        std::vector<std::thread> threads;
+        auto t1 = system_clock::now();
+        for (size_t t = 0; t < n; t++) {
+            threads.emplace_back([&, t]() {
+                size_t k = 0;
+                for (size_t i = t; i < count; i += n) {
+                    k += hs.insert(data[i % data.size()].first);
+                }
+                inserted += k;
+            });
+        }
+        for (auto &t : threads) t.join();
+        auto t2 = system_clock::now();
+        assert(inserted == data.size());
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "_%s_", name);
+        printf("|%-40s|%8zu|%12zu|%8.1f|\n", buf, n, count,
+            (float)count / duration_cast<microseconds>(t2-t1).count());
+    }
+    printf("|%-40s|%8s|%12s|%8s|\n", "-", "-", "-", "-");
+}
+
+static const size_t strides[] = { 1, 16, 256, 4096, 65536, 0 };
+
+/* inserts keys with a constant stride and reports the mean and maximum
+ * distance of the keys from their home slots */
+template <typename Map>
+void bench_probe(const char *name, size_t count)
+{
+    for (const size_t *s = strides; *s != 0; s++) {
+        Map ht;
+        auto t1 = system_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            ht[i * *s] = i;
+        }
+        auto t2 = system_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            assert(ht.find(i * *s)->second == i);
+        }
+        auto t3 = system_clock::now();
+        size_t sum = 0, max = 0;
+        for (auto i = ht.begin(); i != ht.end(); i++) {
+            size_t d = (i.i - ht.key_index(i->first)) & ht.index_mask();
+            sum += d;
+            if (d > max) max = d;
+        }
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "_%s_", name);
+        printf("|%-40s|%8zu|%12zu|%8.1f|%8.1f|%8.2f|%8zu|\n", buf, *s, count,
+            duration_cast<nanoseconds>(t2-t1).count()/(float)count,
+            duration_cast<nanoseconds>(t3-t2).count()/(float)count,
+            sum / (float)count, max);
+    }
+    printf("|%-40s|%8s|%12s|%8s|%8s|%8s|%8s|\n", "-", "-", "-", "-", "-", "-", "-");
+}
+
+void heading_probe()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|%8s|%8s|%8s|\n",
+        "container", "stride", "count", "insert", "lookup", "probe", "max");
+    printf("|%-40s|%8s|%12s|%8s|%8s|%8s|%8s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:", "------:", "------:", "------:");
+}
+
+void heading_load()
+{
+    printf("\n");
+    printf("|%-40s|%8s|%12s|%8s|%8s|%8s|%10s|\n",
+        "container", "load", "count", "insert", "lookup", "miss", "bytes/ent");
+    printf("|%-40s|%8s|%12s|%8s|%8s|%8s|%10s|\n",
+        ":--------------------------------------",
+        "-----:", "----:", "------:", "------:", "------:", "--------:");
+}
+
 void heading()
 {
     printf("\n");
@@ -178,4 +640,59 @@ int main(int argc, char **argv)
     heading();
     bench_map<ethical::hash_map<size_t,size_t>>("ethical::hash_map", count);
     bench_map<ethical::linked_hash_map<size_t,size_t>>("ethical::linked_hash_map", count);
+
+    heading_load();
+    bench_load<ethical::hash_map<size_t,size_t>>("ethical::hash_map", count);
+    bench_load<ethical::hash_map<size_t,size_t,std::hash<size_t>,
+        std::equal_to<size_t>,robin_hood_policy>>("ethical::hash_map<robin_hood>", count);
+    bench_load<ethical::linked_hash_map<size_t,size_t>>("ethical::linked_hash_map", count);
+    bench_load<ethical::linked_hash_map<size_t,size_t,int32_t,std::hash<size_t>,
+        std::equal_to<size_t>,split_links_policy>>("ethical::linked_hash_map<split_links>", count);
+    bench_load<ethical::hash_map<size_t,large_value>>("ethical::hash_map<large>", count);
+    bench_load<ethical::hash_map<size_t,large_value,std::hash<size_t>,
+        std::equal_to<size_t>,split_values_policy>>("ethical::hash_map<large,split_values>", count);
+
+    heading_batch();
+    bench_batch<ethical::hash_map<size_t,size_t>>("ethical::hash_map", count);
+    bench_batch<ethical::linked_hash_map<size_t,size_t>>("ethical::linked_hash_map", count);
+
+    heading_build();
+    bench_build<ethical::hash_map<size_t,size_t>>("ethical::hash_map", count);
+    bench_build<ethical::hash_map<size_t,size_t,std::hash<size_t>,
+        std::equal_to<size_t>,parallel_policy>>("ethical::hash_map<parallel_resize>", count);
+    bench_build<ethical::linked_hash_map<size_t,size_t>>("ethical::linked_hash_map", count);
+
+    heading_latency();
+    bench_latency<ethical::hash_map<size_t,size_t>>("ethical::hash_map", count);
+    bench_latency<ethical::incremental_hash_map<size_t,size_t>>("ethical::incremental_hash_map", count);
+
+    heading_small();
+    {
+        typedef ethical::hash_map<size_t,size_t,std::hash<size_t>,std::equal_to<size_t>,
+            ethical::hash_policy,ethical::hash_pool_allocator<char>> pool_map_t;
+        ethical::hash_pool pool;
+        bench_small<ethical::hash_map<size_t,size_t>>("ethical::hash_map", "std", count, {});
+        bench_small<pool_map_t>("ethical::hash_map", "pool", count, &pool);
+        bench_small<ethical::hash_map<size_t,size_t,std::hash<size_t>,
+            std::equal_to<size_t>,inline_policy>>("ethical::hash_map<inline>", "std", count, {});
+    }
+
+    heading_readers();
+    bench_readers<shared_mutex_map<size_t,size_t>>("shared_mutex<ethical::hash_map>", count);
+    bench_readers<ethical::concurrent_hash_map<size_t,size_t>>("ethical::concurrent_hash_map", count);
+
+    heading_writers();
+    bench_writers<mutex_map<size_t,size_t>>("mutex<ethical::hash_map>", count);
+    bench_writers<ethical::sharded_hash_map<size_t,size_t>>("ethical::sharded_hash_map", count);
+
+    heading_writers();
+    bench_dedup<mutex_set<uint64_t>>("mutex<ethical::hash_set>", count);
+    bench_dedup<ethical::concurrent_hash_set<uint64_t>>("ethical::concurrent_hash_set", count);
+
+    heading_probe();
+    bench_probe<ethical::hash_map<size_t,size_t,std::hash<size_t>,
+        std::equal_to<size_t>,identity_policy>>("ethical::hash_map<hash_mix_none>", count >> 4);
+    bench_probe<ethical::hash_map<size_t,size_t>>("ethical::hash_map<hash_mix_fibonacci>", count >> 4);
+    bench_probe<ethical::hash_map<size_t,size_t,std::hash<size_t>,
+        std::equal_to<size_t>,xxh3_policy>>("ethical::hash_map<hash_mix_xxh3>", count >> 4);
 }
\ No newline at end of file
@@ -0,0 +1,162 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+
+#include <map>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include <string>
+#include <memory>
+#include <utility>
+#include <memory_resource>
+
+#include "concurrent_hash_map.h"
+
+typedef ethical::concurrent_hash_map<uintptr_t,uintptr_t> map_t;
+
+void test_concurrent_hash_map_simple()
+{
+    map_t ht;
+    for (uintptr_t i = 0; i < 1000; i++) assert(ht.insert(i, i + 1));
+    assert(!ht.insert(0, 7) && ht.size() == 1000);
+    for (uintptr_t i = 0; i < 1000; i++) {
+        uintptr_t v = 0;
+        assert(ht.find(i, v) && v == i + 1);
+    }
+    assert(!ht.insert_or_assign(0, 7) && ht.insert_or_assign(1000, 1));
+    uintptr_t v = 0;
+    assert(ht.find(0, v) && v == 7 && ht.size() == 1001);
+    assert(ht.erase(0) && !ht.erase(0) && !ht.contains(0));
+    assert(ht.size() == 1000);
+    size_t n = 0;
+    ht.for_each([&](uintptr_t k, uintptr_t v) {
+        assert(v == (k == 1000 ? 1 : k + 1));
+        n++;
+    });
+    assert(n == 1000);
+    ht.clear();
+    assert(ht.size() == 0 && !ht.contains(1));
+}
+
+void test_concurrent_hash_map_churn()
+{
+    /* updates and erases leave tombstones that purges drop */
+    map_t ht;
+    std::map<uintptr_t,uintptr_t> hm;
+    std::default_random_engine random_engine;
+    std::uniform_int_distribution<uint64_t> random_dist;
+    for (size_t i = 0; i < 1<<16; i++) {
+        uintptr_t key = random_dist(random_engine) & 1023;
+        uintptr_t val = random_dist(random_engine);
+        if (val & 1) {
+            assert(ht.erase(key) == (hm.erase(key) == 1));
+        } else {
+            assert(ht.insert_or_assign(key, val) == (hm.find(key) == hm.end()));
+            hm[key] = val;
+        }
+    }
+    assert(ht.size() == hm.size() && ht.capacity() <= 4096);
+    for (auto &ent : hm) {
+        uintptr_t v;
+        assert(ht.find(ent.first, v) && v == ent.second);
+    }
+}
+
+/* tracks the bytes outstanding from a resource */
+struct counting_resource : std::pmr::memory_resource
+{
+    std::atomic<size_t> bytes{0};
+
+    void* do_allocate(size_t n, size_t a) override
+    {
+        bytes += n;
+        return std::pmr::new_delete_resource()->allocate(n, a);
+    }
+    void do_deallocate(void *p, size_t n, size_t a) override
+    {
+        bytes -= n;
+        std::pmr::new_delete_resource()->deallocate(p, n, a);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override
+    {
+        return this == &o;
+    }
+};
+
+void test_concurrent_hash_map_reclaim()
+{
+    typedef ethical::concurrent_hash_map<uintptr_t,std::string,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,ethical::hash_policy,
+        std::pmr::polymorphic_allocator<char>> string_map_t;
+
+    counting_resource r;
+    {
+        string_map_t ht(&r);
+        ht.insert(1, "one");
+        size_t idle = r.bytes;
+
+        /* a table retired inside a read section outlives the section */
+        ht.visit(1, [&](const std::string &v) {
+            ht.clear();
+            assert(v == "one" && r.bytes == idle * 2);
+        });
+        assert(ht.retired.size() == 1);
+        ht.reclaim();
+        assert(ht.retired.empty() && r.bytes == idle);
+
+        /* growth retires each table, freed when no reader holds it */
+        for (uintptr_t i = 0; i < 10000; i++) ht.insert(i, std::to_string(i));
+        assert(ht.retired.empty() && ht.size() == 10000);
+    }
+    assert(r.bytes == 0);
+}
+
+void test_concurrent_hash_map_readers()
+{
+    /* readers check that the keys that are always present are found
+     * with a consistent value while the writer updates, erases and
+     * inserts enough to rebuild the table many times */
+    static const uintptr_t stable = 1000, versions = 20000;
+    map_t ht;
+    for (uintptr_t i = 0; i < stable; i++) ht.insert(i, i);
+
+    std::atomic<bool> done{false};
+    std::atomic<size_t> reads{0};
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < 4; t++) {
+        readers.emplace_back([&, t]() {
+            size_t n = 0;
+            for (uintptr_t i = t; !done.load(std::memory_order_relaxed); i++) {
+                uintptr_t k = i % stable, v = 0;
+                assert(ht.find(k, v) && v % stable == k);
+                n++;
+            }
+            reads += n;
+        });
+    }
+    for (uintptr_t r = 1; r < versions; r++) {
+        uintptr_t k = r % stable;
+        ht.insert_or_assign(k, k + r * stable);
+        ht.insert(stable + r, r);
+        if (r > 100) ht.erase(stable + r - 100);
+        if (r % 64 == 0) std::this_thread::yield();
+    }
+    done = true;
+    for (auto &t : readers) t.join();
+    assert(ht.size() == stable + 100 && reads > 0);
+    ht.reclaim();
+    assert(ht.retired.empty());
+}
+
+int main(int argc, char **argv)
+{
+    test_concurrent_hash_map_simple();
+    test_concurrent_hash_map_churn();
+    test_concurrent_hash_map_reclaim();
+    test_concurrent_hash_map_readers();
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,111 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+
+#include <set>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include <utility>
+
+#include "concurrent_hash_set.h"
+
+typedef ethical::concurrent_hash_set<uint64_t> set_t;
+
+void test_concurrent_hash_set_simple()
+{
+    set_t hs;
+    for (uint64_t i = 0; i < 10000; i++) assert(hs.insert(i * 3));
+    assert(hs.size() == 10000 && hs.capacity() >= 20000);
+    for (uint64_t i = 0; i < 30000; i++) assert(hs.contains(i) == (i % 3 == 0));
+    assert(!hs.insert(0) && hs.erase(0) && !hs.erase(0) && !hs.contains(0));
+    assert(hs.insert(0) && hs.contains(0) && hs.size() == 10000);
+}
+
+void test_concurrent_hash_set_churn()
+{
+    /* tombstones are never reused, so churn rebuilds the table at the
+     * same capacity instead of growing it */
+    set_t hs;
+    std::set<uint64_t> ss;
+    std::default_random_engine random_engine;
+    std::uniform_int_distribution<uint64_t> random_dist;
+    for (size_t i = 0; i < 1<<16; i++) {
+        uint64_t key = random_dist(random_engine) & 1023;
+        if (random_dist(random_engine) & 1) {
+            assert(hs.erase(key) == (ss.erase(key) == 1));
+        } else {
+            assert(hs.insert(key) == ss.insert(key).second);
+        }
+    }
+    assert(hs.size() == ss.size() && hs.capacity() <= 4096);
+    for (uint64_t key = 0; key < 1024; key++) {
+        assert(hs.contains(key) == (ss.count(key) == 1));
+    }
+}
+
+void test_concurrent_hash_set_dedup()
+{
+    /* threads insert overlapping ranges through many resizes and
+     * exactly one insert of each key succeeds */
+    static const size_t threads = 4, count = 100000;
+    set_t hs;
+    std::atomic<size_t> inserted{0};
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            size_t n = 0;
+            for (uint64_t i = 0; i < count; i++) {
+                uint64_t key = (i + t * count / 2) % (count * 2);
+                if (hs.insert(key)) n++;
+                assert(hs.contains(key));
+                if (i % 256 == 0) std::this_thread::yield();
+            }
+            inserted += n;
+        });
+    }
+    for (auto &t : workers) t.join();
+    assert(inserted == count * 2 && hs.size() == count * 2);
+    for (uint64_t key = 0; key < count * 2; key++) assert(hs.contains(key));
+}
+
+void test_concurrent_hash_set_erase()
+{
+    /* threads insert and erase keys of their own while others do the
+     * same, so every key ends in the state its thread left it */
+    static const size_t threads = 4, count = 20000;
+    set_t hs;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            for (size_t r = 0; r < 4; r++) {
+                for (uint64_t i = 0; i < count; i++) {
+                    uint64_t key = i * threads + t;
+                    if (r % 2 == 0) assert(hs.insert(key));
+                    else if (i % 2 == 0) assert(hs.erase(key));
+                    else assert(!hs.insert(key));
+                    if (i % 256 == 0) std::this_thread::yield();
+                }
+                if (r % 2 == 1) {
+                    for (uint64_t i = 0; i < count; i += 2) assert(hs.insert(i * threads + t));
+                    for (uint64_t i = 0; i < count; i++) assert(hs.erase(i * threads + t));
+                }
+            }
+        });
+    }
+    for (auto &t : workers) t.join();
+    assert(hs.size() == 0);
+    for (uint64_t key = 0; key < count * threads; key++) assert(!hs.contains(key));
+}
+
+int main(int argc, char **argv)
+{
+    test_concurrent_hash_set_simple();
+    test_concurrent_hash_set_churn();
+    test_concurrent_hash_set_dedup();
+    test_concurrent_hash_set_erase();
+    return 0;
+}
\ No newline at end of file
@@ -6,10 +6,17 @@
 
 #include <map>
 #include <random>
+#include <vector>
 #include <chrono>
+#include <memory>
+#include <string>
+#include <limits>
 #include <utility>
+#include <memory_resource>
 
 #include "hash_map.h"
+#include "hash_allocator.h"
+#include "test_policies.h"
 
 using namespace std::chrono;
 
@@ -47,6 +54,42 @@ void test_hash_map_delete()
     assert(ht.find(7) == ht.end());
 }
 
+void test_hash_map_reinsert()
+{
+    ethical::hash_map<uintptr_t,uintptr_t> ht;
+    ht.insert(7, 8);
+    ht.erase(7);
+    ht.insert(7, 9);
+    assert(ht.find(7)->second == 9);
+    assert(ht.size() == 1);
+}
+
+void test_hash_map_sparse()
+{
+    ethical::hash_map<uintptr_t,uintptr_t> ht;
+    size_t count = 0, sum = 0;
+
+    for (uintptr_t i = 0; i < 1000; i++) {
+        ht.insert(i, i);
+    }
+    for (uintptr_t i = 0; i < 1000; i++) {
+        if (i % 97 != 0) ht.erase(i);
+    }
+    for (auto ent : ht) {
+        assert(ent.first % 97 == 0 && ent.second == ent.first);
+        count++;
+        sum += ent.first;
+    }
+    assert(count == 11 && sum == 97 * 55);
+
+    ethical::hash_map<uintptr_t,uintptr_t> hu(ht);
+    ht.clear();
+    assert(ht.begin() == ht.end());
+    count = 0;
+    for (auto i = hu.begin(); i != hu.end(); i++) count++;
+    assert(count == 11);
+}
+
 void test_hash_map_copy()
 {
     static const number_pair_t numbers[] = {
@@ -128,6 +171,111 @@ void test_hash_map_noloop()
     h.find(0);
 }
 
+void test_hash_map_load_factor()
+{
+    ethical::hash_map<uintptr_t,uintptr_t> ht;
+
+    ht.max_load_factor(0.9f);
+    for (uintptr_t i = 0; i < 900; i++) {
+        ht.insert(i * 16, i);
+    }
+    assert(ht.capacity() == 1024);
+    ht.max_load_factor(0.25f);
+    assert(ht.capacity() == 4096);
+    ht.max_load_factor(2.0f);
+    assert(ht.max_load_factor() == 0.9375f);
+    ht.max_load_factor(-1.0f);
+    assert(ht.max_load_factor() == 0.0625f);
+    ht.max_load_factor(std::numeric_limits<float>::quiet_NaN());
+    assert(ht.max_load_factor() == 0.0625f && ht.capacity() == 16384);
+    for (uintptr_t i = 0; i < 900; i++) {
+        assert(ht.find(i * 16)->second == i);
+    }
+}
+
+void test_hash_map_reserve()
+{
+    ethical::hash_map<uintptr_t,uintptr_t> ht(100), hu;
+    assert(ht.capacity() == 128);
+
+    hu.reserve(1000);
+    assert(hu.capacity() == 2048);
+    for (uintptr_t i = 0; i < 1000; i++) {
+        hu.insert(i, i);
+    }
+    assert(hu.capacity() == 2048);
+    for (uintptr_t i = 0; i < 900; i++) {
+        hu.erase(i);
+    }
+    hu.rehash(0);
+    assert(hu.capacity() == 256);
+    for (uintptr_t i = 900; i < 1000; i++) {
+        assert(hu.find(i)->second == i);
+    }
+
+    ethical::hash_map<uintptr_t,uintptr_t> hv = { {1, 2}, {3, 4}, {5, 6} };
+    assert(hv.size() == 3 && hv.capacity() == 8);
+    assert(hv.find(3)->second == 4);
+
+    std::map<uintptr_t,uintptr_t> hm = { {7, 8}, {9, 10} };
+    ethical::hash_map<uintptr_t,uintptr_t> hw(hm.begin(), hm.end());
+    assert(hw.size() == 2 && hw.find(9)->second == 10);
+
+    /* an empty range still builds a table of min_size slots */
+    std::vector<std::pair<uint16_t,uint16_t>> hn;
+    ethical::hash_map<uint16_t,uint16_t> hx(hn.begin(), hn.end());
+    assert(hx.capacity() == hx.min_size && ((uintptr_t)hx.bitmap & 7) == 0);
+    hx[1] = 2;
+    assert(hx.size() == 1 && hx.find(1)->second == 2);
+}
+
+void test_hash_map_resize_move()
+{
+    ethical::hash_map<uintptr_t,std::unique_ptr<uintptr_t>> ht;
+    for (uintptr_t i = 0; i < 1000; i++) {
+        ht[i] = std::make_unique<uintptr_t>(i);
+    }
+    for (uintptr_t i = 0; i < 1000; i++) {
+        assert(*ht.find(i)->second == i);
+    }
+
+    ethical::hash_map<uintptr_t,ethical::hash_map<uintptr_t,uintptr_t>> hm;
+    for (uintptr_t i = 0; i < 1000; i++) {
+        for (uintptr_t j = 0; j < 8; j++) {
+            hm[i][j] = i + j;
+        }
+    }
+    for (uintptr_t i = 0; i < 1000; i++) {
+        assert(hm[i].size() == 8 && hm[i][7] == i + 7);
+    }
+}
+
+void test_hash_map_emplace()
+{
+    ethical::hash_map<uintptr_t,std::unique_ptr<uintptr_t>> ht;
+    auto r = ht.try_emplace(7, new uintptr_t(8));
+    assert(r.second && *r.first->second == 8);
+    std::unique_ptr<uintptr_t> p = std::make_unique<uintptr_t>(9);
+    r = ht.try_emplace(7, std::move(p));
+    assert(!r.second && *r.first->second == 8 && p);
+    r = ht.insert_or_assign(7, std::move(p));
+    assert(!r.second && *r.first->second == 9 && !p);
+    r = ht.insert_or_assign(11, std::make_unique<uintptr_t>(12));
+    assert(r.second && *r.first->second == 12);
+    r = ht.emplace(13, std::make_unique<uintptr_t>(14));
+    assert(r.second && *ht.find(13)->second == 14);
+    ht.insert(std::make_pair(15, std::make_unique<uintptr_t>(16)));
+    assert(ht.size() == 4 && *ht[15] == 16);
+
+    ethical::hash_map<std::string,std::string> hs;
+    std::string k = "key", v = "value";
+    for (size_t i = 0; i < 100; i++) {
+        hs[std::to_string(i)] = std::to_string(i);
+    }
+    hs[std::move(k)] = std::move(v);
+    assert(hs.find("key")->second == "value" && hs.size() == 101);
+}
+
 template <typename F>
 void insert_random(size_t limit, F fn)
 {
@@ -157,12 +305,711 @@ void test_hash_map_random(size_t limit)
     }
 }
 
+struct dense_policy : ethical::hash_policy
+{
+    static constexpr float max_load_factor = 0.9375f;
+};
+
+struct shift_fingerprint_policy : shift_policy
+{
+    static const bool fingerprint = true;
+};
+
+typedef ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+    std::equal_to<uintptr_t>,shift_fingerprint_policy> shift_map_t;
+
+struct dense_robin_hood_policy : robin_hood_policy
+{
+    static constexpr float max_load_factor = 0.875f;
+};
+
+typedef ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+    std::equal_to<uintptr_t>,dense_robin_hood_policy> robin_hood_map_t;
+
+void test_hash_map_backward_shift()
+{
+    /* a cluster that wraps from the last slot to the first */
+    shift_map_t ht(16);
+    uintptr_t keys[] = { 15, 31, 14, 47, 0, 1 };
+    for (uintptr_t k : keys) ht[k] = k + 1;
+    ht.erase(15);
+    assert(ht.find(15) == ht.end() && ht.tombs == 0);
+    for (uintptr_t k : keys) {
+        if (k != 15) assert(ht.find(k)->second == k + 1);
+    }
+    ht.erase(14);
+    ht.erase(0);
+    assert(ht.size() == 3 && ht.tombs == 0);
+    assert(ht.find(31)->second == 32 && ht.find(47)->second == 48);
+    assert(ht.find(1)->second == 2 && ht.find(0) == ht.end());
+}
+
+struct robin_hood_identity_policy : dense_robin_hood_policy
+{
+    typedef ethical::hash_mix_none mixer;
+};
+
+struct constant_hash
+{
+    size_t operator()(uintptr_t) const { return 0; }
+};
+
+void test_hash_map_robin_hood_constant()
+{
+    /* with one hash for every key, growth cannot shorten the cluster,
+     * so the displacements saturate and the table grows by load only */
+    ethical::hash_map<uintptr_t,uintptr_t,constant_hash,
+        std::equal_to<uintptr_t>,robin_hood_policy> ht;
+    for (uintptr_t i = 0; i < 1000; i++) ht[i] = i + 1;
+    assert(ht.size() == 1000 && ht.capacity() <= 4096);
+    for (uintptr_t i = 0; i < 1000; i++) assert(ht.find(i)->second == i + 1);
+    assert(ht.find(1000) == ht.end());
+    for (uintptr_t i = 0; i < 1000; i += 2) ht.erase(i);
+    for (uintptr_t i = 0; i < 1000; i++) {
+        auto j = ht.find(i);
+        if (i & 1) assert(j->second == i + 1);
+        else assert(j == ht.end());
+    }
+    for (uintptr_t i = 1000; i < 1300; i++) ht[i] = i + 1;
+    assert(ht.size() == 800 && ht.tombs == 0);
+    size_t n = 0;
+    for (auto &ent : ht) {
+        assert(ent.second == ent.first + 1 && (ent.first >= 1000 || ent.first & 1));
+        n++;
+    }
+    assert(n == 800);
+}
+
+void test_hash_map_robin_hood()
+{
+    /* 300 keys with one home slot exceed the displacement bound. the
+     * table is not grown past what the load needs, and probes scan on
+     * past the saturated displacements */
+    ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,robin_hood_identity_policy> ht;
+    for (uintptr_t i = 0; i < 300; i++) ht[i << 16] = i;
+    assert(ht.capacity() <= 1024);
+    assert(ht.find(300 << 16) == ht.end() && ht.find(1) == ht.end());
+    for (uintptr_t i = 0; i < 300; i++) {
+        assert(ht.find(i << 16)->second == i);
+    }
+    for (uintptr_t i = 0; i < 300; i += 2) ht.erase(i << 16);
+    for (uintptr_t i = 0; i < 300; i++) {
+        auto j = ht.find(i << 16);
+        if (i & 1) assert(j->second == i);
+        else assert(j == ht.end());
+    }
+    assert(ht.size() == 150 && ht.tombs == 0);
+
+    /* clusters of entries with nearby home slots */
+    robin_hood_map_t hs(64);
+    std::map<uintptr_t,uintptr_t> hm;
+    insert_random(1<<12, [&](size_t key, size_t val) {
+        key &= 127;
+        if (val & 1) {
+            hs.erase(key);
+            hm.erase(key);
+        } else {
+            hs[key] = val;
+            hm[key] = val;
+        }
+        for (uintptr_t k = 0; k < 128; k++) {
+            auto j = hm.find(k);
+            if (j == hm.end()) assert(hs.find(k) == hs.end());
+            else assert(hs.find(k)->second == j->second);
+        }
+    });
+}
+
+/* returns the longest distance of a key from its home slot */
+template <typename Map>
+size_t max_probe(Map &ht)
+{
+    size_t n = 0;
+    for (auto i = ht.begin(); i != ht.end(); i++) {
+        size_t d = (i.i - ht.key_index(i->first)) & ht.index_mask();
+        if (d > n) n = d;
+    }
+    return n;
+}
+
+void test_hash_map_mix()
+{
+    /* with the identity hash, keys with a stride of 4096 share two home slots */
+    ethical::hash_map<uintptr_t,uintptr_t> hd;
+    ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,identity_policy> hi;
+    for (uintptr_t i = 0; i < 4096; i++) {
+        hd[i << 12] = i;
+        hi[i << 12] = i;
+    }
+    assert(max_probe(hd) < 64);
+    assert(max_probe(hi) >= 2047);
+    for (uintptr_t i = 0; i < 4096; i++) {
+        assert(hd.find(i << 12)->second == i && hi.find(i << 12)->second == i);
+    }
+}
+
+struct counting_hash
+{
+    static inline size_t count;
+    size_t operator()(const std::string &s) const
+    {
+        count++;
+        return std::hash<std::string>()(s);
+    }
+};
+
+void test_hash_map_store_hash()
+{
+    /* growth reuses the stored hashes, so each insert hashes once */
+    ethical::hash_map<std::string,uintptr_t,counting_hash,
+        std::equal_to<std::string>,store_hash_policy> ht;
+    counting_hash::count = 0;
+    for (uintptr_t i = 0; i < 10000; i++) {
+        ht[std::to_string(i)] = i;
+    }
+    assert(counting_hash::count == 10000 && ht.capacity() == 32768);
+    for (uintptr_t i = 0; i < 10000; i += 2) {
+        ht.erase(std::to_string(i));
+    }
+    ht.purge();
+    assert(counting_hash::count == 15000);
+    for (uintptr_t i = 0; i < 10000; i++) {
+        auto j = ht.find(std::to_string(i));
+        if (i & 1) assert(j->second == i);
+        else assert(j == ht.end());
+    }
+}
+
+/* a stateful hasher that drops the low shift bits of the key */
+struct shifted_hash
+{
+    unsigned shift;
+    size_t operator()(uintptr_t key) const { return key >> shift; }
+};
+
+void test_hash_map_seeded()
+{
+    /* the hasher is per instance and copied with the map */
+    typedef ethical::hash_map<uintptr_t,uintptr_t,shifted_hash,
+        std::equal_to<uintptr_t>,identity_policy> shifted_map_t;
+    shifted_map_t h1(16, shifted_hash{0}), h2(16, shifted_hash{8});
+    for (uintptr_t i = 0; i < 256; i++) {
+        h1[i] = i;
+        h2[i << 8] = i;
+    }
+    shifted_map_t h3 = h2;
+    assert(h3.hash_function().shift == 8);
+    assert(max_probe(h1) == 0 && max_probe(h2) == 0 && max_probe(h3) == 0);
+
+    /* keys that share one home slot under the identity hash are spread
+     * by the seed, and two instances use different seeds */
+    typedef ethical::hash_map<uintptr_t,uintptr_t,ethical::seeded_hash<uintptr_t>,
+        std::equal_to<uintptr_t>,identity_policy> seeded_map_t;
+    seeded_map_t s1, s2;
+    for (uintptr_t i = 0; i < 4096; i++) {
+        s1[i << 20] = i;
+        s2[i << 20] = i;
+    }
+    assert(max_probe(s1) < 64 && max_probe(s2) < 64);
+    assert(s1.hash_function().seed != s2.hash_function().seed);
+    for (uintptr_t i = 0; i < 4096; i++) {
+        assert(s1.find(i << 20)->second == i && s2.find(i << 20)->second == i);
+    }
+    assert(sizeof(seeded_map_t) == sizeof(ethical::hash_map<uintptr_t,uintptr_t>) + 8);
+
+    ethical::hash_map<std::string,uintptr_t,ethical::seeded_hash<std::string>> ss;
+    for (uintptr_t i = 0; i < 1000; i++) ss[std::to_string(i)] = i;
+    for (uintptr_t i = 0; i < 1000; i++) assert(ss[std::to_string(i)] == i);
+}
+
+/* a hasher salted with a string, which holds a pointer into itself */
+struct salted_hash
+{
+    std::string salt;
+    size_t operator()(const std::string &key) const
+    {
+        return std::hash<std::string>()(salt + key);
+    }
+};
+
+void test_hash_map_salted()
+{
+    /* maps with a hasher that is not trivially relocatable are moved
+     * with the move constructor when the outer map grows, even with a
+     * trivially relocatable allocator */
+    typedef ethical::hash_map<std::string,uintptr_t,salted_hash,
+        std::equal_to<std::string>,ethical::hash_policy,
+        ethical::hash_pool_allocator<char>> salted_map_t;
+    static_assert(!ethical::is_trivially_relocatable<salted_hash>::value);
+    static_assert(!ethical::is_trivially_relocatable<salted_map_t>::value);
+    ethical::hash_pool pool;
+    {
+        ethical::hash_map<uintptr_t,salted_map_t> mm;
+        for (uintptr_t i = 0; i < 1000; i++) {
+            auto &m = mm.try_emplace(i, 16, salted_hash{ "s" + std::to_string(i) },
+                std::equal_to<std::string>(), &pool).first->second;
+            m[std::to_string(i)] = i;
+        }
+        for (uintptr_t i = 0; i < 1000; i++) {
+            auto &m = mm.find(i)->second;
+            assert(m.hash_function().salt == "s" + std::to_string(i));
+            assert(m.find(std::to_string(i))->second == i);
+        }
+    }
+}
+
+template <typename Map>
+void test_hash_map_find_many()
+{
+    Map ht;
+    std::vector<uintptr_t> keys;
+    for (uintptr_t i = 0; i < 1000; i++) {
+        ht[i * 3] = i;
+        keys.push_back(i * 2);
+    }
+    std::vector<typename Map::iterator> out(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    ht.find_many(keys.data(), keys.size(), out.data());
+    ht.contains_many(keys.data(), keys.size(), found.get());
+    for (size_t k = 0; k < keys.size(); k++) {
+        assert(out[k] == ht.find(keys[k]));
+        assert(found[k] == (keys[k] % 3 == 0));
+        if (found[k]) assert(out[k]->second == keys[k] / 3);
+    }
+}
+
+template <typename Map>
+void test_hash_map_churn(size_t limit)
+{
+    Map ht;
+    std::map<uintptr_t,uintptr_t> hm;
+
+    insert_random(limit, [&](size_t key, size_t val) {
+        key &= 1023;
+        if (val & 1) {
+            ht.erase(key);
+            hm.erase(key);
+        } else {
+            ht[key] = val;
+            hm[key] = val;
+        }
+    });
+
+    assert(ht.size() == hm.size());
+    if (Map::policy_type::backward_shift) assert(ht.tombs == 0);
+    for (auto &ent : hm) {
+        assert(ht.find(ent.first)->second == ent.second);
+    }
+    for (uintptr_t key = 0; key < 1024; key++) {
+        assert((ht.find(key) == ht.end()) == (hm.find(key) == hm.end()));
+    }
+}
+
+template <typename Map>
+void test_hash_map_purge()
+{
+    /* a sliding window of 100 live random keys must not grow the table */
+    Map ht;
+    std::vector<uintptr_t> keys;
+    insert_random(100000, [&](size_t key, size_t) {
+        keys.push_back(key);
+        ht[key] = keys.size();
+        if (keys.size() > 100) ht.erase(keys[keys.size() - 101]);
+        assert(ht.capacity() <= 512);
+    });
+    assert(ht.size() == 100);
+
+    ht.purge();
+    assert(ht.tombs == 0 && ht.capacity() <= 512);
+    ht.shrink_to_fit();
+    assert(ht.capacity() == 256 && ht.size() == 100);
+    for (size_t i = 0; i < keys.size(); i++) {
+        auto j = ht.find(keys[i]);
+        if (i < keys.size() - 100) assert(j == ht.end());
+        else assert(j->second == i + 1);
+    }
+    size_t n = 0;
+    for (auto &&ent : ht) {
+        assert(ent.second > keys.size() - 100);
+        n++;
+    }
+    assert(n == 100);
+}
+
+template <typename Map>
+void test_hash_map_insert_range()
+{
+    /* duplicates within the range assign, the last value wins */
+    std::vector<std::pair<uintptr_t,uintptr_t>> v;
+    for (uintptr_t i = 0; i < 10000; i++) v.push_back({ i % 7000, i });
+    Map ht(v.begin(), v.end());
+    assert(ht.size() == 7000);
+    for (uintptr_t i = 0; i < 7000; i++) {
+        assert(ht.find(i)->second == (i < 3000 ? i + 7000 : i));
+    }
+
+    /* a range that fits within the load factor never grows the table */
+    size_t limit = ht.capacity();
+    std::map<uintptr_t,uintptr_t> m;
+    for (uintptr_t i = 6000; i < 8000; i++) m[i] = i + 1;
+    ht.insert(m.begin(), m.end());
+    assert(ht.size() == 8000 && ht.capacity() == limit);
+    for (uintptr_t i = 0; i < 8000; i++) {
+        assert(ht.find(i)->second == (i < 3000 ? i + 7000 : i < 6000 ? i : i + 1));
+    }
+
+    /* a range that does not fit is sized for once */
+    v.clear();
+    for (uintptr_t i = 0; i < 100000; i++) v.push_back({ i, i });
+    ht.insert(v.begin(), v.end());
+    assert(ht.size() == 100000);
+    assert(ht.capacity() == Map::capacity_for(108000, Map::load_factor));
+
+    /* move iterators move both keys and values */
+    ethical::hash_map<uintptr_t,std::unique_ptr<uintptr_t>> hu;
+    std::vector<std::pair<uintptr_t,std::unique_ptr<uintptr_t>>> w;
+    for (uintptr_t i = 0; i < 100; i++) w.emplace_back(i, std::make_unique<uintptr_t>(i));
+    hu.insert(std::make_move_iterator(w.begin()), std::make_move_iterator(w.end()));
+    for (uintptr_t i = 0; i < 100; i++) {
+        assert(!w[i].second && *hu.find(i)->second == i);
+    }
+}
+
+/* tracks the bytes outstanding from a resource */
+struct counting_resource : std::pmr::memory_resource
+{
+    size_t bytes = 0;
+
+    void* do_allocate(size_t n, size_t align) override
+    {
+        bytes += n;
+        return std::pmr::new_delete_resource()->allocate(n, align);
+    }
+    void do_deallocate(void *p, size_t n, size_t align) override
+    {
+        bytes -= n;
+        std::pmr::new_delete_resource()->deallocate(p, n, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override
+    {
+        return this == &o;
+    }
+};
+
+void test_hash_map_allocator()
+{
+    typedef ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,ethical::hash_policy,
+        std::pmr::polymorphic_allocator<char>> pmr_map_t;
+
+    counting_resource r1, r2;
+    {
+        pmr_map_t a(&r1), b(&r2);
+        size_t initial = r2.bytes;
+        for (uintptr_t i = 0; i < 1000; i++) a[i] = i;
+        assert(r1.bytes > 0 && r2.bytes == initial);
+        assert(((uintptr_t)a.data & (alignof(uint64_t) - 1)) == 0);
+
+        /* unequal resources do not propagate, so the entries move */
+        b = std::move(a);
+        assert(b.get_allocator().resource() == &r2);
+        assert(b.size() == 1000 && a.size() == 0 && a.find(7) == a.end());
+        for (uintptr_t i = 0; i < 1000; i++) assert(b.find(i)->second == i);
+        a[7] = 8;
+        assert(a.size() == 1 && a.find(7)->second == 8);
+
+        pmr_map_t c(b);
+        assert(c.get_allocator().resource() == std::pmr::get_default_resource());
+        assert(c == b);
+    }
+    assert(r1.bytes == 0 && r2.bytes == 0);
+
+    /* large tables are mapped on a huge page boundary */
+    typedef ethical::hash_large_allocator<char> large_allocator;
+    ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,ethical::hash_policy,large_allocator> ht;
+    assert(((uintptr_t)ht.data & (large_allocator::cache_line_size - 1)) == 0);
+    ht.reserve(1 << 18);
+    if (ht.capacity() * sizeof(ht.data[0]) >= large_allocator::threshold) {
+        assert(((uintptr_t)ht.data & (large_allocator::huge_page_size - 1)) == 0);
+    }
+    for (uintptr_t i = 0; i < (1 << 18); i++) ht[i] = i;
+    for (uintptr_t i = 0; i < (1 << 18); i++) assert(ht.find(i)->second == i);
+}
+
+void test_hash_map_pool()
+{
+    typedef ethical::hash_map<uint32_t,uint32_t,std::hash<uint32_t>,
+        std::equal_to<uint32_t>,ethical::hash_policy,
+        ethical::hash_pool_allocator<char>> pool_map_t;
+
+    ethical::hash_pool pool;
+    {
+        ethical::hash_map<uint32_t,pool_map_t> graph;
+        for (uint32_t n = 0; n < 1000; n++) {
+            auto &edges = graph.try_emplace(n, &pool).first->second;
+            for (uint32_t e = 0; e < n % 40; e++) edges[e] = n + e;
+        }
+        for (uint32_t n = 0; n < 1000; n++) {
+            auto &edges = graph.find(n)->second;
+            assert(edges.size() == n % 40 && edges.get_allocator().pool == &pool);
+            for (uint32_t e = 0; e < n % 40; e++) assert(edges.find(e)->second == n + e);
+        }
+        auto s = pool.stats();
+        assert(s.used == 1000 && s.large == 0 && s.slabs > 0);
+
+        pool_map_t big(&pool);
+        for (uint32_t e = 0; e < 1000; e++) big[e] = e;
+        assert(pool.stats().large == 1 && pool.stats().used == 1000);
+    }
+    auto s = pool.stats();
+    assert(s.used == 0 && s.large == 0 && s.free > 0 && s.free_bytes > 0);
+
+    /* the next tables of the same classes reuse the freed blocks */
+    size_t slabs = s.slabs;
+    {
+        std::vector<pool_map_t> maps;
+        for (uint32_t n = 0; n < 1000; n++) {
+            maps.emplace_back(&pool);
+            for (uint32_t e = 0; e < n % 40; e++) maps.back()[e] = n + e;
+        }
+        assert(pool.stats().used == 1000);
+    }
+    assert(pool.stats().slabs == slabs && pool.stats().used == 0);
+}
+
+void test_hash_map_inline()
+{
+    typedef ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,inline_policy,
+        std::pmr::polymorphic_allocator<char>> inline_map_t;
+
+    counting_resource r;
+    {
+        /* tables of up to 16 slots live in the object */
+        inline_map_t a(&r);
+        for (uintptr_t i = 0; i < 8; i++) a[i] = i;
+        assert(r.bytes == 0 && a.capacity() == 16 && a.inline_internal());
+        assert((char*)a.data > (char*)&a && (char*)a.data < (char*)(&a + 1));
+
+        /* moves copy the inline table and leave the source empty */
+        inline_map_t b(std::move(a));
+        assert(b.size() == 8 && a.size() == 0 && b.inline_internal());
+        for (uintptr_t i = 0; i < 8; i++) assert(b.find(i)->second == i);
+        a[100] = 1;
+        assert(a.size() == 1 && a.find(100)->second == 1);
+
+        /* the table spills when it grows and returns when it shrinks */
+        for (uintptr_t i = 0; i < 100; i++) b[i] = i;
+        assert(r.bytes > 0 && !b.inline_internal());
+        for (uintptr_t i = 8; i < 100; i++) b.erase(i);
+        b.shrink_to_fit();
+        assert(b.capacity() == 16 && b.inline_internal() && r.bytes == 0);
+
+        inline_map_t c(b), d(&r);
+        d = c;
+        assert(c == b && d == b && r.bytes == 0);
+        d = std::move(a);
+        assert(d.size() == 1 && a.size() == 0 && d.find(100)->second == 1);
+    }
+    assert(r.bytes == 0);
+
+    /* containers of inline maps relocate them with the move constructor */
+    typedef ethical::hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,inline_policy> small_map_t;
+    static_assert(!ethical::is_trivially_relocatable<small_map_t>::value);
+    ethical::hash_map<uintptr_t,small_map_t> mm;
+    for (uintptr_t i = 0; i < 1000; i++) {
+        auto &m = mm[i];
+        for (uintptr_t j = 0; j < i % 10; j++) m[j] = i + j;
+    }
+    for (uintptr_t i = 0; i < 1000; i++) {
+        auto &m = mm.find(i)->second;
+        assert(m.size() == i % 10 && m.inline_internal() == (i % 10 <= 8));
+        for (uintptr_t j = 0; j < i % 10; j++) assert(m.find(j)->second == i + j);
+    }
+}
+
+struct split_robin_hood_policy : split_values_policy
+{
+    static const bool robin_hood = true;
+    static const bool store_hash = true;
+};
+
+struct split_shift_policy : split_values_policy
+{
+    static const bool backward_shift = true;
+    static const bool fingerprint = true;
+};
+
+struct alignas(32) large_value
+{
+    uintptr_t id;
+    char pad[120];
+};
+
+void test_hash_map_split_values()
+{
+    /* keys are packed in the slots and values are aligned after them */
+    typedef ethical::hash_map<uintptr_t,large_value,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,split_values_policy> split_map_t;
+    static_assert(sizeof(split_map_t::data_type) == sizeof(uintptr_t));
+    split_map_t ht;
+    for (uintptr_t i = 0; i < 10000; i++) ht[i].id = i * 7;
+    for (uintptr_t i = 0; i < 10000; i++) {
+        auto j = ht.find(i);
+        assert(j->first == i && j->second.id == i * 7);
+        assert(((uintptr_t)&j->second & 31) == 0);
+        assert((char*)&j->second >= (char*)(ht.data + ht.capacity()));
+        assert((char*)&j->second < (char*)ht.bitmap);
+    }
+    size_t n = 0;
+    for (auto [k, v] : ht) {
+        assert(v.id == k * 7);
+        v.id = k;
+        n++;
+    }
+    assert(n == 10000 && ht.find(9999)->second.id == 9999);
+    const split_map_t &hk = ht;
+    n = 0;
+    for (auto i = hk.begin(); i != hk.end(); i++, n++) assert(i->second.id == i->first);
+    assert(n == 10000);
+
+    /* values that are not trivially relocatable follow their keys */
+    typedef ethical::hash_map<uintptr_t,std::string,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,split_shift_policy> string_map_t;
+    string_map_t hs;
+    std::map<uintptr_t,std::string> hm;
+    insert_random(1<<14, [&](size_t key, size_t val) {
+        key &= 1023;
+        if (val & 1) {
+            hs.erase(key);
+            hm.erase(key);
+        } else {
+            hs.insert_or_assign(key, std::to_string(val));
+            hm[key] = std::to_string(val);
+        }
+    });
+    assert(hs.size() == hm.size());
+    for (auto &ent : hm) assert(hs.find(ent.first)->second == ent.second);
+    string_map_t hc(hs), hn(std::move(hc));
+    assert(hn == hs);
+    hs.rehash(4096);
+    assert(hn == hs);
+}
+
+struct parallel_policy : ethical::hash_policy
+{
+    static constexpr float max_load_factor = 0.875f;
+    static const size_t parallel_resize = 4096;
+    static const size_t resize_threads = 4;
+};
+
+struct parallel_store_hash_policy : parallel_policy
+{
+    typedef ethical::hash_mix_none mixer;
+    static const bool store_hash = true;
+};
+
+struct parallel_split_policy : parallel_policy
+{
+    static const bool split_values = true;
+    static const bool fingerprint = true;
+};
+
+template <typename Map>
+void test_hash_map_parallel_resize(uintptr_t stride)
+{
+    /* each doubling from 4096 slots splits the table among 4 threads,
+     * and runs of keys with adjacent slots straddle the range seams */
+    Map ht;
+    for (uintptr_t i = 0; i < 100000; i++) ht[i * stride] = std::to_string(i);
+    assert(ht.size() == 100000);
+    for (uintptr_t i = 0; i < 100000; i++) {
+        assert(ht.find(i * stride)->second == std::to_string(i));
+        assert(ht.find((i + 100000) * stride) == ht.end());
+    }
+    size_t n = 0;
+    for (auto &&ent : ht) {
+        assert(ent.second == std::to_string(ent.first / stride));
+        n++;
+    }
+    assert(n == 100000);
+
+    /* shrinking resizes serially */
+    for (uintptr_t i = 1000; i < 100000; i++) ht.erase(i * stride);
+    ht.shrink_to_fit();
+    ht.reserve(1 << 18);
+    assert(ht.size() == 1000);
+    for (uintptr_t i = 0; i < 1000; i++) {
+        assert(ht.find(i * stride)->second == std::to_string(i));
+    }
+}
+
 int main(int argc, char **argv)
 {
     test_hash_map_simple();
     test_hash_map_delete();
+    test_hash_map_reinsert();
+    test_hash_map_sparse();
     test_hash_map_noloop();
     test_hash_map_random(1<<16);
+    test_hash_map_churn<ethical::hash_map<uintptr_t,uintptr_t>>(1<<16);
+    test_hash_map_churn<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,fingerprint_policy>>(1<<16);
+    test_hash_map_churn<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,dense_policy>>(1<<16);
+    test_hash_map_churn<shift_map_t>(1<<16);
+    test_hash_map_backward_shift();
+    test_hash_map_purge<shift_map_t>();
+    test_hash_map_churn<robin_hood_map_t>(1<<16);
+    test_hash_map_robin_hood();
+    test_hash_map_robin_hood_constant();
+    test_hash_map_mix();
+    test_hash_map_store_hash();
+    test_hash_map_seeded();
+    test_hash_map_salted();
+    test_hash_map_find_many<ethical::hash_map<uintptr_t,uintptr_t>>();
+    test_hash_map_find_many<robin_hood_map_t>();
+    test_hash_map_find_many<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,store_hash_robin_hood_policy>>();
+    test_hash_map_churn<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,store_hash_policy>>(1<<16);
+    test_hash_map_churn<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,store_hash_robin_hood_policy>>(1<<16);
+    test_hash_map_purge<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,store_hash_policy>>();
+    test_hash_map_purge<ethical::hash_map<uintptr_t,uintptr_t>>();
+    test_hash_map_purge<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,fingerprint_policy>>();
+    test_hash_map_insert_range<ethical::hash_map<uintptr_t,uintptr_t>>();
+    test_hash_map_insert_range<robin_hood_map_t>();
+    test_hash_map_allocator();
+    test_hash_map_pool();
+    test_hash_map_inline();
+    test_hash_map_split_values();
+    test_hash_map_churn<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_values_policy>>(1<<16);
+    test_hash_map_churn<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_robin_hood_policy>>(1<<16);
+    test_hash_map_purge<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_values_policy>>();
+    test_hash_map_find_many<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_robin_hood_policy>>();
+    test_hash_map_insert_range<ethical::hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_values_policy>>();
+    test_hash_map_load_factor();
+    test_hash_map_parallel_resize<ethical::hash_map<uintptr_t,std::string,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,parallel_policy>>(3);
+    test_hash_map_parallel_resize<ethical::hash_map<uintptr_t,std::string,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,parallel_store_hash_policy>>(2);
+    test_hash_map_parallel_resize<ethical::hash_map<uintptr_t,std::string,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,parallel_split_policy>>(5);
+    test_hash_map_reserve();
+    test_hash_map_resize_move();
+    test_hash_map_emplace();
     test_hash_map_copy();
     test_hash_map_move();
     return 0;
@@ -11,12 +11,13 @@
 #include "sha256.h"
 #include "hash_map.h"
 #include "hash_set.h"
+#include "test_policies.h"
 
 struct hash_hash_map
 {
     typedef ethical::hash_map<int,int> hash_map_t;
 
-    size_t operator()(hash_map_t &m)
+    size_t operator()(const hash_map_t &m)
     {
         uint8_t b[32];
         sha256_ctx ctx;
@@ -58,6 +59,44 @@ make_map(std::initializer_list<std::pair<int,int>> l)
     return std::move(m);
 }
 
+void test_hash_set_small()
+{
+    /* the smallest tables keep the bitmap after the keys word aligned */
+    ethical::hash_set<uint32_t> ht;
+    ht.shrink_to_fit();
+    assert(ht.capacity() == ht.min_size && ((uintptr_t)ht.bitmap & 7) == 0);
+    for (uint32_t i = 1; i <= 3; i++) ht.insert(i);
+    ht.rehash(0);
+    assert(ht.capacity() == ht.min_size && ht.size() == 3);
+    for (uint32_t i = 1; i <= 3; i++) assert(ht.find(i)->first == i);
+
+    ethical::hash_set<uint8_t> hs(1);
+    assert(hs.capacity() == 1 && ((uintptr_t)hs.bitmap & 7) == 0);
+    hs.insert(7);
+    assert(hs.find(7)->first == 7 && hs.find(8) == hs.end());
+}
+
+struct constant_hash
+{
+    size_t operator()(uintptr_t) const { return 0; }
+};
+
+void test_hash_set_robin_hood_constant()
+{
+    /* keys sharing one hash saturate the displacements without growth */
+    ethical::hash_set<uintptr_t,constant_hash,std::equal_to<uintptr_t>,
+        robin_hood_policy> ht;
+    for (uintptr_t i = 0; i < 1000; i++) ht.insert(i);
+    assert(ht.size() == 1000 && ht.capacity() <= 4096);
+    for (uintptr_t i = 0; i < 1000; i += 2) ht.erase(i);
+    for (uintptr_t i = 0; i < 1000; i++) {
+        auto j = ht.find(i);
+        if (i & 1) assert(j->first == i);
+        else assert(j == ht.end());
+    }
+    assert(ht.size() == 500 && ht.find(1000) == ht.end());
+}
+
 typedef ethical::hash_map<int,int> hash_map_t;
 typedef ethical::hash_set<hash_map_t,hash_hash_map> hash_set_t;
 
@@ -81,5 +120,7 @@ int main(int argc, char **argv)
 {
     test_hash_set_simple();
     test_hash_set_hash_map();
+    test_hash_set_small();
+    test_hash_set_robin_hood_constant();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,193 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+
+#include "incremental_hash_map.h"
+#include "test_policies.h"
+
+typedef ethical::incremental_hash_map<uintptr_t,uintptr_t> map_t;
+
+struct split_fingerprint_policy : split_values_policy
+{
+    static const bool fingerprint = true;
+};
+
+struct sparse_policy : ethical::hash_policy
+{
+    static constexpr float max_load_factor = 0.0625f;
+    static constexpr float purge_factor = 0.125f;
+};
+
+void test_incremental_hash_map_simple()
+{
+    map_t ht;
+    for (uintptr_t i = 0; i < 1000; i++) assert(ht.try_emplace(i, i + 1).second);
+    assert(!ht.try_emplace(0, 7).second && ht.find(0)->second == 1);
+    assert(!ht.insert_or_assign(0, 7).second && ht[0] == 7);
+    assert(ht.size() == 1000);
+    ht.erase(0);
+    ht.erase(0);
+    assert(!ht.contains(0) && ht.find(0) == ht.end() && ht.size() == 999);
+    size_t n = 0, sum = 0;
+    for (auto &ent : ht) {
+        n++;
+        sum += ent.second;
+    }
+    assert(n == 999 && sum == 1000 * 1001 / 2 - 1);
+    ht.clear();
+    assert(ht.empty() && !ht.migrating() && ht.begin() == ht.end());
+}
+
+void test_incremental_hash_map_growth()
+{
+    /* the table is only replaced by starting a migration, never grown
+     * in place, and lookups find keys in both tables meanwhile */
+    map_t ht;
+    size_t limit = ht.capacity(), migrations = 0, steps = 0;
+    for (uintptr_t i = 0; i < 1<<17; i++) {
+        ht[i] = i * 3;
+        if (ht.capacity() != limit) {
+            assert(ht.migrating() && ht.table.size() == 1 && ht.old->size() > 0);
+            assert(ht.capacity() == limit << 1);
+            limit = ht.capacity();
+            migrations++;
+        }
+        if (ht.migrating()) {
+            steps++;
+            if ((i & 255) == 0) {
+                for (uintptr_t j = 0; j <= i; j += 97) assert(ht.find(j)->second == j * 3);
+            }
+        }
+    }
+    assert(migrations == 14 && steps > (1 << 16) / 64);
+    size_t n = 0;
+    for (auto &ent : ht) {
+        assert(ent.second == ent.first * 3);
+        n++;
+    }
+    assert(n == 1<<17 && ht.size() == 1<<17);
+    while (ht.migrate(map_t::migrate_step)) {}
+    assert(!ht.old && ht.table.size() == 1<<17);
+}
+
+template <typename Map, typename F>
+void test_incremental_hash_map_churn(size_t limit, F val)
+{
+    /* random inserts and erases of 4096 keys stay in step with std::map
+     * while migrations are in progress */
+    Map ht;
+    std::map<uintptr_t,decltype(val(0))> hm;
+    std::default_random_engine random_engine;
+    std::uniform_int_distribution<uint64_t> random_dist;
+    size_t migrating = 0;
+
+    for (size_t i = 0; i < limit; i++) {
+        uint64_t r = random_dist(random_engine);
+        uintptr_t key = (r >> 8) & 4095;
+        if (r & 1) {
+            ht.erase(key);
+            hm.erase(key);
+        } else {
+            ht.insert_or_assign(key, val(r));
+            hm[key] = val(r);
+        }
+        if (ht.migrating()) {
+            assert(!ht.grow_due());
+            migrating++;
+        }
+        if ((i & 4095) == 0) {
+            assert(ht.size() == hm.size());
+            for (auto &ent : hm) assert(ht.find(ent.first)->second == ent.second);
+        }
+    }
+    assert(migrating > 0);
+    size_t n = 0;
+    for (auto &&ent : ht) {
+        assert(hm.find(ent.first)->second == ent.second);
+        n++;
+    }
+    assert(n == hm.size());
+    for (uintptr_t key = 0; key < 4096; key++) {
+        assert(ht.contains(key) == (hm.find(key) != hm.end()));
+    }
+}
+
+void test_incremental_hash_map_existing()
+{
+    /* updates of existing keys at the load factor do not start a
+     * migration, only the insert of a new key does */
+    map_t ht(1024);
+    uintptr_t n = 0;
+    while (!ht.grow_due()) ht[n++] = 0;
+    ht[0] = 1;
+    assert(!ht.try_emplace(1, 2).second && !ht.insert_or_assign(2, 3).second);
+    assert(!ht.migrating() && ht.capacity() == 1024);
+    ht[n] = 4;
+    assert(ht.migrating() && ht.capacity() == 2048 && ht.size() == n + 1);
+    assert(ht[0] == 1 && ht[1] == 0 && ht[2] == 3 && ht[n] == 4);
+}
+
+void test_incremental_hash_map_headroom()
+{
+    /* a same size rebuild at a low purge_factor leaves room for only
+     * 1/128 of the slots, so the step grows to finish the migration
+     * before the new table fills with new keys */
+    ethical::incremental_hash_map<uintptr_t,uintptr_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,sparse_policy> ht(1<<17);
+    for (uintptr_t i = 0; i < 7168; i++) ht[i] = i;
+    for (uintptr_t i = 0; i < 1024; i++) ht.erase(i * 7);
+    size_t migrating = 0;
+    for (uintptr_t i = 7168; i < 16384; i++) {
+        ht[i] = i;
+        if (ht.migrating()) {
+            assert(!ht.grow_due());
+            if (ht.capacity() == 1<<17) assert(ht.step > map_t::migrate_step);
+            migrating++;
+        }
+    }
+    assert(migrating > 0 && ht.capacity() == 1<<18);
+    assert(ht.size() == 16384 - 1024);
+    for (uintptr_t i = 0; i < 16384; i++) {
+        assert(ht.contains(i) == (i >= 7168 || i % 7 != 0 || i / 7 >= 1024));
+    }
+}
+
+void test_incremental_hash_map_purge()
+{
+    /* a sliding window of live keys is rebuilt at the same capacity */
+    map_t ht;
+    for (uintptr_t i = 0; i < 1<<16; i++) {
+        ht[i] = i;
+        if (i >= 100) ht.erase(i - 100);
+    }
+    assert(ht.size() == 100 && ht.capacity() <= 1024);
+    for (uintptr_t i = (1<<16) - 100; i < 1<<16; i++) assert(ht.find(i)->second == i);
+}
+
+int main(int argc, char **argv)
+{
+    test_incremental_hash_map_simple();
+    test_incremental_hash_map_growth();
+    test_incremental_hash_map_churn<map_t>(1<<18,
+        [](uint64_t r) { return (uintptr_t)r; });
+    test_incremental_hash_map_churn<ethical::incremental_hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,shift_policy>>(1<<18,
+        [](uint64_t r) { return (uintptr_t)r; });
+    test_incremental_hash_map_churn<ethical::incremental_hash_map<uintptr_t,uintptr_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,store_hash_robin_hood_policy>>(1<<18,
+        [](uint64_t r) { return (uintptr_t)r; });
+    test_incremental_hash_map_churn<ethical::incremental_hash_map<uintptr_t,std::string,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_fingerprint_policy>>(1<<16,
+        [](uint64_t r) { return std::to_string(r); });
+    test_incremental_hash_map_headroom();
+    test_incremental_hash_map_existing();
+    test_incremental_hash_map_purge();
+    return 0;
+}
\ No newline at end of file
@@ -6,10 +6,14 @@
 
 #include <map>
 #include <random>
+#include <vector>
 #include <chrono>
+#include <memory>
+#include <string>
 #include <utility>
 
 #include "linked_hash_map.h"
+#include "test_policies.h"
 
 using namespace std::chrono;
 
@@ -125,6 +129,88 @@ void test_linked_hash_map_delete()
     assert(ht.find(7) == ht.end());
 }
 
+void test_linked_hash_map_init()
+{
+    ethical::linked_hash_map<uintptr_t,uintptr_t> ht = {
+        { 666, 4 }, { 888, 2 }, {999, 3}, { 777, 1 }
+    };
+
+    static const number_pair_t numbers[] = {
+        { 666, 4 }, { 888, 2 }, {999, 3}, { 777, 1 }
+    };
+
+    size_t i = 0;
+    for (auto ent : ht) {
+        const number_pair_t *n = numbers + i++;
+        assert(ent.first == n->first);
+        assert(ent.second == n->second);
+    }
+    assert(i == 4 && ht.capacity() == 8);
+
+    ht.reserve(100);
+    assert(ht.capacity() == 256);
+    i = 0;
+    for (auto ent : ht) {
+        const number_pair_t *n = numbers + i++;
+        assert(ent.first == n->first);
+    }
+}
+
+void test_linked_hash_map_resize_move()
+{
+    ethical::linked_hash_map<uintptr_t,std::unique_ptr<std::string>> ht;
+    for (uintptr_t i = 0; i < 1000; i++) {
+        ht[i] = std::make_unique<std::string>(std::to_string(i));
+    }
+    uintptr_t i = 0;
+    for (auto &ent : ht) {
+        assert(ent.first == i && *ent.second == std::to_string(i));
+        i++;
+    }
+    assert(i == 1000);
+}
+
+void test_linked_hash_map_reinsert()
+{
+    ethical::linked_hash_map<uintptr_t,uintptr_t> ht;
+    ht.insert(7, 8);
+    ht.insert(9, 10);
+    ht.erase(7);
+    ht.insert(7, 9);
+    assert(ht.find(7)->second == 9);
+    assert(ht.size() == 2);
+    assert(ht.begin()->first == 9);
+}
+
+void test_linked_hash_map_emplace()
+{
+    ethical::linked_hash_map<uintptr_t,std::unique_ptr<uintptr_t>> ht;
+    auto r = ht.try_emplace(7, new uintptr_t(8));
+    assert(r.second && *r.first->second == 8);
+    std::unique_ptr<uintptr_t> p = std::make_unique<uintptr_t>(9);
+    r = ht.try_emplace(7, std::move(p));
+    assert(!r.second && *r.first->second == 8 && p);
+    r = ht.insert_or_assign(7, std::move(p));
+    assert(!r.second && *r.first->second == 9 && !p);
+    r = ht.insert_or_assign(11, std::make_unique<uintptr_t>(12));
+    assert(r.second && *r.first->second == 12);
+    r = ht.emplace_hint(ht.begin(), 5, std::make_unique<uintptr_t>(6));
+    assert(r.second && ht.begin()->first == 5);
+
+    /* the returned iterator must follow the entry across a resize */
+    for (uintptr_t i = 100; i < 1100; i++) {
+        r = ht.emplace(i, std::make_unique<uintptr_t>(i));
+        assert(r.second && r.first->first == i && *r.first->second == i);
+    }
+    uintptr_t keys[] = { 5, 7, 11 }, i = 0;
+    for (auto &ent : ht) {
+        if (i < 3) assert(ent.first == keys[i]);
+        else assert(ent.first == i + 97);
+        i++;
+    }
+    assert(i == ht.size() && i == 1003);
+}
+
 template <typename F>
 void insert_random(size_t limit, F fn)
 {
@@ -139,9 +225,17 @@ void insert_random(size_t limit, F fn)
     }
 }
 
+struct split_links_shift_policy : split_links_policy
+{
+    static const bool backward_shift = true;
+    static const bool fingerprint = true;
+    static const bool store_hash = true;
+};
+
+template <typename Map>
 void test_linked_hash_map_random(size_t limit)
 {
-    ethical::linked_hash_map<uintptr_t,uintptr_t> ht;
+    Map ht;
     std::map<uintptr_t,uintptr_t> hm;
 
     insert_random(limit, [&](size_t key, size_t val) {
@@ -152,14 +246,218 @@ void test_linked_hash_map_random(size_t limit)
     for (auto &ent : hm) {
         assert(ht.find(ent.first)->second == ent.second);
     }
+
+    size_t n = 0;
+    for (auto &ent : hm) {
+        if (n++ & 1) ht.erase(ent.first);
+    }
+    n = 0;
+    for (auto &ent : hm) {
+        auto i = ht.find(ent.first);
+        if (n++ & 1) assert(i == ht.end());
+        else assert(i->second == ent.second);
+    }
+    n = 0;
+    for (auto i = ht.begin(); i != ht.end(); i++) n++;
+    assert(n == ht.size() && n == (hm.size() + 1) / 2);
+    if (Map::policy_type::backward_shift) assert(ht.tombs == 0);
+}
+
+template <typename Map>
+void test_linked_hash_map_purge()
+{
+    /* a sliding window of 100 live random keys must not grow the table */
+    Map ht;
+    std::vector<uintptr_t> keys;
+    insert_random(100000, [&](size_t key, size_t) {
+        keys.push_back(key);
+        ht[key] = keys.size();
+        if (keys.size() > 100) ht.erase(keys[keys.size() - 101]);
+        assert(ht.capacity() <= 512);
+    });
+    assert(ht.size() == 100);
+
+    ht.purge();
+    assert(ht.tombs == 0 && ht.capacity() <= 512);
+    ht.shrink_to_fit();
+    assert(ht.capacity() == 256 && ht.size() == 100);
+    for (size_t i = 0; i < keys.size(); i++) {
+        auto j = ht.find(keys[i]);
+        if (i < keys.size() - 100) assert(j == ht.end());
+        else assert(j->second == i + 1);
+    }
+    size_t i = keys.size() - 100;
+    for (auto &ent : ht) {
+        assert(ent.first == keys[i] && ent.second == i + 1);
+        i++;
+    }
+    assert(i == keys.size());
+}
+
+void test_linked_hash_map_find_many()
+{
+    ethical::linked_hash_map<uintptr_t,uintptr_t> ht;
+    std::vector<uintptr_t> keys;
+    for (uintptr_t i = 0; i < 1000; i++) {
+        ht[i * 3] = i;
+        keys.push_back(i * 2);
+    }
+    std::vector<ethical::linked_hash_map<uintptr_t,uintptr_t>::iterator> out(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    ht.find_many(keys.data(), keys.size(), out.data());
+    ht.contains_many(keys.data(), keys.size(), found.get());
+    for (size_t k = 0; k < keys.size(); k++) {
+        assert(out[k] == ht.find(keys[k]));
+        assert(found[k] == (keys[k] % 3 == 0));
+        if (found[k]) assert(out[k]->second == keys[k] / 3);
+        else assert(out[k] == ht.end());
+    }
+}
+
+void test_linked_hash_map_insert_range()
+{
+    /* range entries are appended in order, duplicates keep their place */
+    std::vector<std::pair<uintptr_t,uintptr_t>> v;
+    for (uintptr_t i = 0; i < 1000; i++) v.push_back({ (i * 3) % 700, i });
+    ethical::linked_hash_map<uintptr_t,uintptr_t> ht(v.begin(), v.end());
+    size_t limit = ht.capacity(), i = 0;
+    assert(ht.size() == 700);
+    for (auto &ent : ht) {
+        assert(ent.first == (i * 3) % 700 && ent.second == (i < 300 ? i + 700 : i));
+        i++;
+    }
+
+    std::map<uintptr_t,uintptr_t> m;
+    for (uintptr_t k = 700; k < 800; k++) m[k] = k;
+    ht.insert(m.begin(), m.end());
+    assert(ht.size() == 800 && ht.capacity() == limit);
+    i = 0;
+    for (auto &ent : ht) {
+        if (i >= 700) assert(ent.first == i && ent.second == i);
+        i++;
+    }
+    assert(i == 800);
+}
+
+void test_linked_hash_map_inline()
+{
+    typedef ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,inline_policy> inline_map_t;
+
+    /* the list order survives moves of the inline table and spilling */
+    inline_map_t a;
+    for (uintptr_t i = 0; i < 4; i++) a[9 - i] = i;
+    assert(a.capacity() == 16 && a.inline_internal());
+    inline_map_t b(std::move(a));
+    assert(b.inline_internal() && a.size() == 0 && a.begin() == a.end());
+    for (uintptr_t i = 4; i < 20; i++) b[9 - i] = i;
+    assert(!b.inline_internal());
+    uintptr_t i = 0;
+    for (auto &ent : b) {
+        assert(ent.first == 9 - i && ent.second == i);
+        i++;
+    }
+    assert(i == 20);
+}
+
+void test_linked_hash_map_split_links()
+{
+    /* with split_links a backward shift moves the entry and its links
+     * separately, so the list is rewired through the link array. the
+     * list must keep insertion order across shifts and resizes, with
+     * the prev and next links of every slot agreeing */
+    typedef ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_links_shift_policy> split_map_t;
+    static_assert(sizeof(split_map_t::data_type) == sizeof(uintptr_t) * 2);
+
+    split_map_t ht;
+    std::vector<uintptr_t> order;
+    auto check = [&]() {
+        int32_t i = ht.head, prev = split_map_t::empty_offset;
+        for (auto key : order) {
+            assert(i != split_map_t::empty_offset && ht.data[i].first == key);
+            assert(ht.data[i].second == key * 3 && ht.link_prev(i) == prev);
+            prev = i;
+            i = ht.link_next(i);
+        }
+        assert(i == split_map_t::empty_offset && ht.tail == prev);
+        assert(ht.size() == order.size() && ht.tombs == 0);
+    };
+
+    for (uintptr_t i = 0; i < 4096; i++) {
+        uintptr_t key = i * 0x9e3779b97f4a7c15ull >> 16;
+        ht.insert(key, key * 3);
+        order.push_back(key);
+    }
+    check();
+
+    /* erase every third key, counting the entries shifted to new slots */
+    std::map<uintptr_t,size_t> slots;
+    for (auto key : order) slots[key] = ht.find(key).i;
+    std::vector<uintptr_t> kept;
+    for (size_t n = 0; n < order.size(); n++) {
+        if (n % 3 == 0) ht.erase(order[n]);
+        else kept.push_back(order[n]);
+    }
+    order.swap(kept);
+    size_t moved = 0;
+    for (auto key : order) moved += ht.find(key).i != slots[key];
+    assert(moved > 0);
+    check();
+
+    /* grow, erase from both ends of the list, then shrink */
+    ht.reserve(ht.capacity() * 2);
+    check();
+    ht.erase(order.front());
+    ht.erase(order.back());
+    order.erase(order.begin());
+    order.pop_back();
+    for (uintptr_t key = 1; key < 64; key++) {
+        ht.insert(key, key * 3);
+        order.push_back(key);
+    }
+    check();
+    size_t limit = ht.capacity();
+    ht.rehash(0);
+    assert(ht.capacity() < limit);
+    check();
 }
 
 int main(int argc, char **argv)
 {
     test_linked_hash_map_simple();
     test_linked_hash_map_insert();
+    test_linked_hash_map_init();
     test_linked_hash_map_delete();
-    test_linked_hash_map_random(1<<16);
+    test_linked_hash_map_reinsert();
+    test_linked_hash_map_resize_move();
+    test_linked_hash_map_emplace();
+    test_linked_hash_map_random<ethical::linked_hash_map<uintptr_t,uintptr_t>>(1<<16);
+    test_linked_hash_map_random<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,fingerprint_policy>>(1<<16);
+    test_linked_hash_map_purge<ethical::linked_hash_map<uintptr_t,uintptr_t>>();
+    test_linked_hash_map_purge<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,fingerprint_policy>>();
+    test_linked_hash_map_random<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,shift_policy>>(1<<16);
+    test_linked_hash_map_purge<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,shift_policy>>();
+    test_linked_hash_map_random<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,store_hash_policy>>(1<<16);
+    test_linked_hash_map_purge<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,store_hash_policy>>();
+    test_linked_hash_map_random<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_links_policy>>(1<<16);
+    test_linked_hash_map_purge<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_links_policy>>();
+    test_linked_hash_map_random<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_links_shift_policy>>(1<<16);
+    test_linked_hash_map_purge<ethical::linked_hash_map<uintptr_t,uintptr_t,int32_t,
+        std::hash<uintptr_t>,std::equal_to<uintptr_t>,split_links_shift_policy>>();
+    test_linked_hash_map_split_links();
+    test_linked_hash_map_find_many();
+    test_linked_hash_map_insert_range();
+    test_linked_hash_map_inline();
     test_linked_hash_map_copy();
     test_linked_hash_map_move();
     return 0;
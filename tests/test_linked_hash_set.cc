@@ -11,12 +11,13 @@
 #include "sha256.h"
 #include "linked_hash_map.h"
 #include "linked_hash_set.h"
+#include "test_policies.h"
 
 struct hash_linked_hash_map
 {
     typedef ethical::linked_hash_map<int,int> hashmap_t;
 
-    size_t operator()(hashmap_t &m)
+    size_t operator()(const hashmap_t &m)
     {
         uint8_t b[32];
         sha256_ctx ctx;
@@ -48,6 +49,29 @@ void test_linked_hash_set_simple()
     }
 }
 
+void test_linked_hash_set_split()
+{
+    ethical::linked_hash_set<uintptr_t,int32_t,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,split_links_policy> ht;
+
+    for (uintptr_t i = 1; i <= 1000; i++) {
+        ht.insert(i);
+    }
+    for (uintptr_t i = 2; i <= 1000; i += 2) {
+        ht.erase(i);
+    }
+    ht.insert(ht.begin(), 2);
+    uintptr_t n = 0;
+    for (auto &ent : ht) {
+        assert(ent.first == (n == 0 ? 2 : n * 2 - 1));
+        n++;
+    }
+    assert(n == 501 && ht.size() == 501);
+    for (uintptr_t i = 1; i <= 1000; i += 2) {
+        assert(ht.find(i)->first == i);
+    }
+}
+
 ethical::linked_hash_map<int,int>
 make_map(std::initializer_list<std::pair<int,int>> l)
 {
@@ -80,6 +104,7 @@ void test_linked_hash_set_hashmap()
 int main(int argc, char **argv)
 {
     test_linked_hash_set_simple();
+    test_linked_hash_set_split();
     test_linked_hash_set_hashmap();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "hash_common.h"
+
+/*
+ * policies shared by the tests and benchmarks. each enables one option
+ * of ethical::hash_policy, or the stated combination, and files derive
+ * their own variants from these.
+ */
+
+struct fingerprint_policy : ethical::hash_policy
+{
+    static const bool fingerprint = true;
+};
+
+struct shift_policy : ethical::hash_policy
+{
+    static const bool backward_shift = true;
+};
+
+struct robin_hood_policy : ethical::hash_policy
+{
+    static const bool robin_hood = true;
+};
+
+struct identity_policy : ethical::hash_policy
+{
+    typedef ethical::hash_mix_none mixer;
+};
+
+struct store_hash_policy : ethical::hash_policy
+{
+    static const bool store_hash = true;
+};
+
+struct store_hash_robin_hood_policy : store_hash_policy
+{
+    static const bool robin_hood = true;
+    static const bool fingerprint = true;
+};
+
+struct inline_policy : ethical::hash_policy
+{
+    static const size_t inline_capacity = 16;
+};
+
+struct split_links_policy : ethical::hash_policy
+{
+    static const bool split_links = true;
+};
+
+struct split_values_policy : ethical::hash_policy
+{
+    static const bool split_values = true;
+};
\ No newline at end of file
@@ -0,0 +1,122 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+
+#include <map>
+#include <thread>
+#include <vector>
+#include <string>
+#include <utility>
+#include <memory_resource>
+
+#include "sharded_hash_map.h"
+
+typedef ethical::sharded_hash_map<uintptr_t,uintptr_t> map_t;
+
+void test_sharded_hash_map_simple()
+{
+    map_t ht;
+    for (uintptr_t i = 0; i < 1000; i++) assert(ht.insert(i, i + 1));
+    assert(!ht.insert(0, 7) && !ht.try_emplace(1, 7) && ht.size() == 1000);
+    for (uintptr_t i = 0; i < 1000; i++) {
+        uintptr_t v = 0;
+        assert(ht.find(i, v) && v == (i == 0 ? 7 : i + 1));
+    }
+    assert(ht.erase(0) && !ht.erase(0) && !ht.contains(0));
+    assert(ht.visit(1, [](uintptr_t &v) { v = 100; }));
+    assert(!ht.visit(0, [](uintptr_t &) { assert(false); }));
+    ht.update(0, [](uintptr_t &v) { assert(v == 0); v = 5; });
+    size_t n = 0, sum = 0;
+    ht.for_each([&](uintptr_t, uintptr_t &v) {
+        n++;
+        sum += v;
+    });
+    assert(n == 1000 && sum == 999 * 1000 / 2 + 999 - 2 + 100 + 5);
+    ht.clear();
+    assert(ht.size() == 0 && !ht.contains(1));
+}
+
+void test_sharded_hash_map_spread()
+{
+    /* strided keys spread across the shards and within each shard */
+    map_t ht;
+    for (uintptr_t i = 0; i < 1<<16; i++) ht.insert(i << 12, i);
+    size_t least = ~(size_t)0, most = 0;
+    ht.foreach_shard([&](map_t::map_type &m) {
+        if (m.size() < least) least = m.size();
+        if (m.size() > most) most = m.size();
+        assert(m.capacity() <= 4096);
+    });
+    assert(least > 768 && most < 1280);
+    for (uintptr_t i = 0; i < 1<<16; i++) {
+        uintptr_t v;
+        assert(ht.find(i << 12, v) && v == i);
+    }
+}
+
+void test_sharded_hash_map_counters()
+{
+    /* concurrent increments of shared counters are not lost */
+    ethical::sharded_hash_map<std::string,size_t,8> ht;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++) {
+        threads.emplace_back([&, t]() {
+            for (size_t r = 0; r < 100; r++) {
+                for (size_t i = 0; i < 1000; i++) {
+                    ht.update(std::to_string((i + t) % 1000), [](size_t &n) { n++; });
+                }
+                if (r % 10 == 0) std::this_thread::yield();
+            }
+        });
+    }
+    for (auto &t : threads) t.join();
+    assert(ht.size() == 1000);
+    ht.for_each([](const std::string &, size_t &n) { assert(n == 400); });
+}
+
+struct counting_resource : std::pmr::memory_resource
+{
+    size_t allocs = 0, frees = 0;
+
+    void* do_allocate(size_t n, size_t align) override
+    {
+        allocs++;
+        return std::pmr::new_delete_resource()->allocate(n, align);
+    }
+    void do_deallocate(void *p, size_t n, size_t align) override
+    {
+        frees++;
+        std::pmr::new_delete_resource()->deallocate(p, n, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &o) const noexcept override
+    {
+        return this == &o;
+    }
+};
+
+void test_sharded_hash_map_construct()
+{
+    /* each shard allocates its table once, at its share of the size */
+    typedef ethical::sharded_hash_map<uintptr_t,uintptr_t,64,std::hash<uintptr_t>,
+        std::equal_to<uintptr_t>,ethical::hash_policy,
+        std::pmr::polymorphic_allocator<char>> pmr_map_t;
+    counting_resource r;
+    {
+        pmr_map_t ht(1<<16, std::hash<uintptr_t>(), std::equal_to<uintptr_t>(), &r);
+        assert(r.allocs == 64 && r.frees == 0 && ht.capacity() == 1<<16);
+        for (uintptr_t i = 0; i < 1000; i++) ht.insert(i, i);
+        assert(ht.size() == 1000 && r.allocs == 64);
+    }
+    assert(r.frees == 64);
+}
+
+int main(int argc, char **argv)
+{
+    test_sharded_hash_map_simple();
+    test_sharded_hash_map_spread();
+    test_sharded_hash_map_counters();
+    test_sharded_hash_map_construct();
+    return 0;
+}
\ No newline at end of file